@@ -0,0 +1,442 @@
+/* Local article cache.
+ *
+ * Articles are stored by the hash of their message-id, as the same
+ * dot-unstuffed text get_segment() writes for a segment, under
+ * <dir>/<xx>/<hash>.  The file starts with a line holding the message-id,
+ * which a lookup compares, so a hash collision is a miss rather than
+ * another article.  An LRU list bounds the total size, CACHE_SIZE unless
+ * cache_size= says otherwise.  The cache is shared between runs and NZBs,
+ * so reposts and restarts into a different output directory do not go
+ * back to the server.
+ *
+ * <dir>/index is rewritten on exit and can be read without nzbnews:
+ *
+ *  cache_index_header  magic "NZBNCACH", version, record count
+ *  cache_record[count] hash, size, last use (time_t), flags
+ *
+ * Records are in LRU order, least recently used first.  flags is
+ * CACHE_RAW for undecoded article text.  The index is only a hint: files
+ * it does not list, left by a run that did not exit cleanly or by another
+ * process sharing the directory, are picked up by cache_init() and by a
+ * lookup that misses the table, so they count towards the bound.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nzbnews.h"
+
+#define CACHE_MAGIC         "NZBNCACH"
+#define CACHE_VERSION       2
+#define CACHE_RAW           0x1
+#define CACHE_BUCKETS       (1 << 18)
+#define CACHE_SIZE          (4ULL << 30)    /* default bound */
+#define CACHE_MSGID_MAX     511         /* what segment_node.msgid holds */
+
+typedef struct _cache_index_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    count;
+} cache_index_header;
+
+typedef struct _cache_record {
+    uint64_t    hash;
+    uint64_t    size;
+    int64_t     atime;
+    uint32_t    flags;
+    uint32_t    pad;
+} cache_record;
+
+typedef struct _cache_entry {
+    struct _cache_entry* hnext;     /* hash chain */
+    struct _cache_entry* prev;      /* LRU list, head is oldest */
+    struct _cache_entry* next;
+    cache_record rec;
+} cache_entry;
+
+static struct _cache_t {
+    pthread_mutex_t lock;
+    char* dir;
+    unsigned long long max;
+    unsigned long long total;
+    unsigned long count;
+    unsigned long hits;
+    unsigned long misses;
+    cache_entry** buckets;
+    cache_entry* head;
+    cache_entry* tail;
+} c = { PTHREAD_MUTEX_INITIALIZER };
+
+/* 64-bit FNV-1a */
+unsigned long long cache_hash(char* str) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    while(*str) {
+        h ^= (unsigned char)*str++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void cache_path(char* buf, size_t len, unsigned long long hash) {
+    snprintf(buf, len, "%s/%02x/%016llx", c.dir, (unsigned int)(hash >> 56), hash);
+}
+
+/* Copy the rest of the open file 'in' to dst */
+static int copy_fd(int in, char* dst) {
+    char buf[65536];
+    int out;
+    ssize_t n;
+    int ret = NN_OK;
+
+    if((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        return NN_ERROR;
+    }
+    while((n = read(in, buf, sizeof(buf))) > 0) {
+        if(write(out, buf, n) != n) {
+            ret = NN_ERROR;
+            break;
+        }
+    }
+    if(n < 0) {
+        ret = NN_ERROR;
+    }
+    close(out);
+    if(ret != NN_OK) {
+        unlink(dst);
+    }
+    return ret;
+}
+
+int copy_file(char* src, char* dst) {
+    int in;
+    int ret;
+
+    if((in = open(src, O_RDONLY)) == -1) {
+        return NN_ERROR;
+    }
+    ret = copy_fd(in, dst);
+    close(in);
+    return ret;
+}
+
+/* Read the message-id line of an open cache file.  Returns NN_OK if it is
+ * msgid's. */
+static int cache_check(int fd, char* msgid) {
+    char buf[CACHE_MSGID_MAX + 2];
+    size_t len = strlen(msgid);
+
+    if(len > CACHE_MSGID_MAX || read(fd, buf, len + 1) != len + 1) {
+        return NN_ERROR;
+    }
+    return !memcmp(buf, msgid, len) && buf[len] == '\n' ? NN_OK : NN_ERROR;
+}
+
+static void lru_unlink(cache_entry* e) {
+    if(e->prev) {
+        e->prev->next = e->next;
+    }
+    else {
+        c.head = e->next;
+    }
+    if(e->next) {
+        e->next->prev = e->prev;
+    }
+    else {
+        c.tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+static void lru_append(cache_entry* e) {
+    e->prev = c.tail;
+    e->next = NULL;
+    if(c.tail) {
+        c.tail->next = e;
+    }
+    else {
+        c.head = e;
+    }
+    c.tail = e;
+}
+
+static cache_entry* cache_find(unsigned long long hash) {
+    cache_entry* e;
+
+    for(e = c.buckets[hash & (CACHE_BUCKETS - 1)]; e; e = e->hnext) {
+        if(e->rec.hash == hash) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void cache_remove(cache_entry* e) {
+    cache_entry** pe;
+    char path[1024];
+
+    for(pe = &c.buckets[e->rec.hash & (CACHE_BUCKETS - 1)]; *pe; pe = &(*pe)->hnext) {
+        if(*pe == e) {
+            *pe = e->hnext;
+            break;
+        }
+    }
+    lru_unlink(e);
+    c.total -= e->rec.size;
+    c.count--;
+    cache_path(path, sizeof(path), e->rec.hash);
+    unlink(path);
+    free(e);
+}
+
+static cache_entry* cache_add(cache_record* rec) {
+    cache_entry* e;
+
+    if((e = (cache_entry*)calloc(1, sizeof(cache_entry))) == NULL) {
+        return NULL;
+    }
+    e->rec = *rec;
+    e->hnext = c.buckets[rec->hash & (CACHE_BUCKETS - 1)];
+    c.buckets[rec->hash & (CACHE_BUCKETS - 1)] = e;
+    lru_append(e);
+    c.total += rec->size;
+    c.count++;
+    return e;
+}
+
+/* Take a file found under the cache directory into the table */
+static cache_entry* cache_adopt(unsigned long long hash, struct stat* finfo) {
+    cache_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.hash = hash;
+    rec.size = finfo->st_size;
+    rec.atime = finfo->st_mtime;
+    rec.flags = CACHE_RAW;
+    return cache_add(&rec);
+}
+
+/* Adopt the files of <dir>/<xx>/ that the index did not list */
+static void cache_scan(void) {
+    char path[1024];
+    struct stat finfo;
+    struct dirent* ent;
+    DIR* dir;
+    unsigned long long hash;
+    char* end;
+    int i;
+
+    for(i = 0; i < 256; i++) {
+        snprintf(path, sizeof(path), "%s/%02x", c.dir, i);
+        if((dir = opendir(path)) == NULL) {
+            continue;
+        }
+        while((ent = readdir(dir)) != NULL) {
+            hash = strtoull(ent->d_name, &end, 16);
+            if(end - ent->d_name != 16 || *end != '\0' || (hash >> 56) != i || cache_find(hash)) {
+                continue;
+            }
+            cache_path(path, sizeof(path), hash);
+            if(stat(path, &finfo) == 0 && S_ISREG(finfo.st_mode)) {
+                cache_adopt(hash, &finfo);
+            }
+        }
+        closedir(dir);
+    }
+}
+
+static void cache_evict(void) {
+    while(c.max && c.total > c.max && c.head) {
+        cache_remove(c.head);
+    }
+}
+
+int cache_init(char* dir, unsigned long long max) {
+    cache_index_header hdr;
+    cache_record rec;
+    char path[1024];
+    struct stat finfo;
+    FILE* fp;
+    unsigned int i;
+
+    c.dir = dir;
+    c.max = max ? max : CACHE_SIZE;
+    if((c.buckets = (cache_entry**)calloc(CACHE_BUCKETS, sizeof(cache_entry*))) == NULL) {
+        perror("calloc");
+        return NN_ERROR;
+    }
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir");
+        return NN_ERROR;
+    }
+
+    snprintf(path, sizeof(path), "%s/index", dir);
+    if((fp = fopen(path, "r")) == NULL) {
+        /* nothing to read */
+    }
+    else if(fread(&hdr, sizeof(hdr), 1, fp) == 1
+    && !memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic))
+    && hdr.version == CACHE_VERSION) {
+        for(i = 0; i < hdr.count && fread(&rec, sizeof(rec), 1, fp) == 1; i++) {
+            /* skip entries whose file has gone missing */
+            cache_path(path, sizeof(path), rec.hash);
+            if(stat(path, &finfo) == 0 && !cache_find(rec.hash)) {
+                cache_add(&rec);
+            }
+        }
+    }
+    else {
+        fprintf(stderr, "%s: ignoring unrecognised cache index\n", __FUNCTION__);
+    }
+    if(fp) {
+        fclose(fp);
+    }
+    cache_scan();
+    cache_evict();
+    DEBUG("%s: %lu articles, %.2f MB cached\n", __FUNCTION__, c.count, c.total / (1024.0 * 1024.0));
+    return NN_OK;
+}
+
+/* Copy a cached article to 'dst'.  Returns NN_OK on a hit. */
+int cache_fetch(char* msgid, char* dst) {
+    unsigned long long hash = cache_hash(msgid);
+    cache_entry* e;
+    char path[1024];
+    struct stat finfo;
+    int ret = NN_ERROR;
+    int fd = -1;
+
+    pthread_mutex_lock(&c.lock);
+    cache_path(path, sizeof(path), hash);
+    if((e = cache_find(hash)) != NULL) {
+        if((fd = open(path, O_RDONLY)) != -1) {
+            e->rec.atime = time(NULL);
+            lru_unlink(e);
+            lru_append(e);
+        }
+        else {
+            cache_remove(e);
+        }
+    }
+    else if((fd = open(path, O_RDONLY)) != -1) {
+        /* stored by another process, or by a run that left no index */
+        if(fstat(fd, &finfo) == 0 && cache_adopt(hash, &finfo) != NULL) {
+            cache_evict();
+        }
+    }
+    pthread_mutex_unlock(&c.lock);
+
+    /* copied outside the lock; the open file survives an eviction */
+    if(fd != -1) {
+        if(cache_check(fd, msgid) == NN_OK) {
+            ret = copy_fd(fd, dst);
+        }
+        close(fd);
+    }
+    if(ret == NN_OK) {
+        __sync_fetch_and_add(&c.hits, 1);
+    }
+    else {
+        __sync_fetch_and_add(&c.misses, 1);
+    }
+    return ret;
+}
+
+int cache_store(char* msgid, char* buf, size_t len) {
+    cache_record rec;
+    char path[1024];
+    char tmp[1056];
+    FILE* fp;
+    cache_entry* e;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.hash = cache_hash(msgid);
+    rec.size = strlen(msgid) + 1 + len;
+    rec.atime = time(NULL);
+    rec.flags = CACHE_RAW;
+
+    if((c.max && rec.size > c.max) || strlen(msgid) > CACHE_MSGID_MAX) {
+        return NN_ERROR;
+    }
+
+    /* written outside the lock; the rename makes it visible atomically */
+    cache_path(path, sizeof(path), rec.hash);
+    snprintf(tmp, sizeof(tmp), "%s/%02x", c.dir, (unsigned int)(rec.hash >> 56));
+    mkdir(tmp, 0755);
+    snprintf(tmp, sizeof(tmp), "%s.%lx.tmp", path, (unsigned long)pthread_self());
+    if((fp = fopen(tmp, "w")) == NULL) {
+        perror("fopen");
+        return NN_ERROR;
+    }
+    if(fprintf(fp, "%s\n", msgid) < 0 || fwrite(buf, 1, len, fp) != len) {
+        fclose(fp);
+        unlink(tmp);
+        return NN_ERROR;
+    }
+    fclose(fp);
+
+    pthread_mutex_lock(&c.lock);
+    if((e = cache_find(rec.hash)) != NULL) {
+        lru_unlink(e);
+        c.total -= e->rec.size;
+        e->rec = rec;
+        c.total += rec.size;
+        lru_append(e);
+    }
+    else {
+        cache_add(&rec);
+    }
+    rename(tmp, path);
+    cache_evict();
+    pthread_mutex_unlock(&c.lock);
+    return NN_OK;
+}
+
+/* Write the index and free the table */
+void cache_cleanup(void) {
+    cache_index_header hdr;
+    cache_entry* e;
+    char path[1024];
+    char tmp[1024];
+    FILE* fp;
+
+    if(!c.buckets) {
+        return;
+    }
+    pthread_mutex_lock(&c.lock);
+    snprintf(path, sizeof(path), "%s/index", c.dir);
+    snprintf(tmp, sizeof(tmp), "%s/index.tmp", c.dir);
+    if((fp = fopen(tmp, "w")) != NULL) {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+        hdr.version = CACHE_VERSION;
+        hdr.count = c.count;
+        fwrite(&hdr, sizeof(hdr), 1, fp);
+        for(e = c.head; e; e = e->next) {
+            fwrite(&e->rec, sizeof(e->rec), 1, fp);
+        }
+        fclose(fp);
+        rename(tmp, path);
+    }
+    else {
+        perror("fopen");
+    }
+    printf("%s: %lu hits, %lu misses, %lu articles (%.2f MB) cached\n", __FUNCTION__,
+        c.hits, c.misses, c.count, c.total / (1024.0 * 1024.0));
+
+    while(c.head) {
+        e = c.head;
+        lru_unlink(e);
+        free(e);
+    }
+    free(c.buckets); c.buckets = NULL;
+    c.total = 0;
+    c.count = 0;
+    pthread_mutex_unlock(&c.lock);
+}
@@ -0,0 +1,155 @@
+/* Adaptive connection count.
+ *
+ * With -A each server starts with a couple of connections.  Every interval
+ * the controller compares the goodput of each server with the previous
+ * interval: while it keeps rising by a margin another connection is added
+ * (up to the server's connections= limit), and on 400s, timeouts or a drop
+ * after an increase the count is cut multiplicatively.  Connections above
+ * the target finish their current segment, log out and park in
+ * connctl_wait() until they are wanted again.  A connection that fails to
+ * connect too many times in a row gives up, and the server's parked
+ * connections with it, so an unreachable server does not hold up the run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "nzbnews.h"
+
+#define CTL_INTERVAL        2       /* seconds between adjustments */
+#define CTL_START           2       /* initial connections per server */
+#define CTL_GAIN            1.05    /* goodput must rise this much to grow */
+#define CTL_DROP            0.80    /* goodput below this after growing backs off */
+
+static struct _connctl_t {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+    short running;
+} ctl = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+void connctl_error(server_node* server) {
+    __sync_fetch_and_add(&server->errors, 1);
+}
+
+/* Give up on a server that cannot be connected to */
+void connctl_unreachable(server_node* server) {
+    pthread_mutex_lock(&ctl.lock);
+    server->unreachable = 1;
+    pthread_cond_broadcast(&ctl.changed);
+    pthread_mutex_unlock(&ctl.lock);
+}
+
+static int connctl_adjust(server_node* server) {
+    unsigned long bytes = server->bytes;
+    unsigned long errors = server->errors;
+    double goodput = (bytes - server->ctl.bytes) / (double)CTL_INTERVAL;
+    int target = server->target;
+
+    if(errors != server->ctl.errors) {
+        target = target / 2;
+        server->ctl.increased = 0;
+    }
+    else if(server->ctl.increased && goodput < server->ctl.goodput * CTL_DROP) {
+        target = target * 3 / 4;
+        server->ctl.increased = 0;
+    }
+    else if(goodput > server->ctl.goodput * CTL_GAIN && target < server->max) {
+        target++;
+        server->ctl.increased = 1;
+    }
+    else {
+        server->ctl.increased = 0;
+    }
+    if(target < 1) {
+        target = 1;
+    }
+
+    server->ctl.bytes = bytes;
+    server->ctl.errors = errors;
+    server->ctl.goodput = goodput;
+
+    if(target != server->target) {
+        printf("%s: %s: %d connections (%.2f kB/s)\n", __FUNCTION__,
+            server->host, target, goodput / 1000);
+        server->target = target;
+        return 1;
+    }
+    return 0;
+}
+
+static void* connctl_thread(void* arg) {
+    server_node* server;
+    struct timeval now;
+    struct timespec until;
+    int changed;
+
+    pthread_mutex_lock(&ctl.lock);
+    while(ctl.running && g.running) {
+        gettimeofday(&now, NULL);
+        until.tv_sec = now.tv_sec + CTL_INTERVAL;
+        until.tv_nsec = now.tv_usec * 1000;
+        pthread_cond_timedwait(&ctl.changed, &ctl.lock, &until);
+        if(!ctl.running) {
+            break;
+        }
+
+        changed = 0;
+        for(server = g.servers; server; server = server->next) {
+            changed |= connctl_adjust(server);
+        }
+        if(changed) {
+            pthread_cond_broadcast(&ctl.changed);
+        }
+    }
+    pthread_mutex_unlock(&ctl.lock);
+    return NULL;
+}
+
+void connctl_start(void) {
+    server_node* server;
+
+    for(server = g.servers; server; server = server->next) {
+        server->target = g.auto_connections && server->max > CTL_START ? CTL_START : server->max;
+        server->ctl.bytes = server->bytes;
+        server->ctl.errors = server->errors;
+    }
+    if(!g.auto_connections) {
+        return;
+    }
+    ctl.running = 1;
+    if(pthread_create(&ctl.thread, NULL, connctl_thread, NULL) != 0) {
+        perror("pthread_create");
+        ctl.running = 0;
+    }
+}
+
+void connctl_stop(void) {
+    if(!ctl.running) {
+        return;
+    }
+    pthread_mutex_lock(&ctl.lock);
+    ctl.running = 0;
+    pthread_cond_broadcast(&ctl.changed);
+    pthread_mutex_unlock(&ctl.lock);
+    pthread_join(ctl.thread, NULL);
+}
+
+/* Park a connection that is above its server's target.  Returns 1 when it
+ * should carry on, 0 when the job is over or the server unreachable. */
+int connctl_wait(connection* conn) {
+    struct timeval now;
+    struct timespec until;
+
+    pthread_mutex_lock(&ctl.lock);
+    while(g.running && conn->slot >= conn->server->target
+    && !conn->server->unreachable && !sched_finished()) {
+        gettimeofday(&now, NULL);
+        until.tv_sec = now.tv_sec + 1;
+        until.tv_nsec = now.tv_usec * 1000;
+        pthread_cond_timedwait(&ctl.changed, &ctl.lock, &until);
+    }
+    pthread_mutex_unlock(&ctl.lock);
+    return g.running && !conn->server->unreachable && !sched_finished();
+}
@@ -0,0 +1,645 @@
+/* Local header database.
+ *
+ * With -D dir, -G group appends the group's overview to a store in dir
+ * instead of writing an NZB, starting after the highest article seen by
+ * the previous run.  Each group has three files:
+ *
+ *  <group>.hdr  header, then one fixed-size record per article
+ *  <group>.str  the subject, poster and message-id strings of the records
+ *  <group>.idx  inverted index from subject tokens to record numbers
+ *
+ * Both data files are only ever appended to.  Strings are written before
+ * the records that point at them and the record count in the header is
+ * written last, so a run that dies leaves at most a tail that the next
+ * writer truncates.
+ *
+ * Tokens are lowercased runs of two or more letters or digits, stored by
+ * 64-bit hash in an open-addressed table with a sorted list of records
+ * each.  -S query maps the files and intersects the lists of the query's
+ * tokens smallest first, then scans the records appended since the index
+ * was last rebuilt.  The index is rebuilt when that tail grows past an
+ * eighth of the indexed records or HDRDB_DELTA_MAX.  Matches go through
+ * index_add() and come back as a file list for the download path.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nzbnews.h"
+
+#define HDRDB_MAGIC         "NZBNHDR1"
+#define HDRDB_IDX_MAGIC     "NZBNIDX1"
+#define HDRDB_VERSION       1
+#define HDRDB_DELTA_MAX     262144      /* unindexed records before a rebuild */
+#define HDRDB_MAX_TOKENS    64          /* per subject, the rest are ignored */
+#define HDRDB_BATCH         4096        /* matches per index_add() call */
+
+typedef struct _hdrdb_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count;             /* records */
+    uint64_t high_water;        /* last article fetched */
+    uint64_t strsize;           /* bytes of the string file in use */
+} hdrdb_header;
+
+typedef struct _hdrdb_record {
+    uint64_t article;
+    uint64_t bytes;
+    int64_t date;
+    uint64_t subject;           /* offsets into the string file */
+    uint64_t poster;
+    uint64_t msgid;
+} hdrdb_record;
+
+typedef struct _hdrdb_idx_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t records;           /* records covered, the rest are scanned */
+    uint64_t slots;             /* a power of two */
+    uint64_t npostings;
+} hdrdb_idx_header;
+
+typedef struct _hdrdb_slot {
+    uint64_t hash;              /* 0 for an empty slot */
+    uint64_t offset;            /* first posting */
+    uint32_t count;
+    uint32_t reserved;
+} hdrdb_slot;
+
+typedef struct _hdrdb_pair {
+    uint64_t hash;
+    uint32_t record;
+} hdrdb_pair;
+
+static struct _hdrdb_t {
+    pthread_mutex_t lock;
+    char path[1024];            /* dir/group, without the extension */
+    int writable;
+    int hdrfd;
+    int strfd;
+    hdrdb_header header;
+    uint64_t indexed;           /* records covered by the .idx file */
+    /* read-only mappings for queries */
+    void* hdrmap;
+    size_t hdrmaplen;
+    char* strmap;
+    size_t strmaplen;
+    void* idxmap;
+    size_t idxmaplen;
+} db = { PTHREAD_MUTEX_INITIALIZER, "", 0, -1, -1 };
+
+#define WORD_CHAR(c)    (((c) >= '0' && (c) <= '9') || (((c) | 0x20) >= 'a' && ((c) | 0x20) <= 'z'))
+
+/* Hash the next token at or after *pos and move *pos past it.  Returns
+ * the token length, or 0 at the end of the string. */
+static int hdrdb_token(const char** pos, uint64_t* hash) {
+    const unsigned char* p = (const unsigned char*)*pos;
+    uint64_t h;
+    int len;
+    int c;
+
+    for(;;) {
+        while(*p && !WORD_CHAR(*p)) {
+            p++;
+        }
+        if(!*p) {
+            *pos = (const char*)p;
+            return 0;
+        }
+        h = 14695981039346656037ULL;
+        for(len = 0; (c = *p) && WORD_CHAR(c); len++, p++) {
+            h = (h ^ (c >= 'A' && c <= 'Z' ? c | 0x20 : c)) * 1099511628211ULL;
+        }
+        if(len >= 2) {
+            *pos = (const char*)p;
+            *hash = h ? h : 1;
+            return len;
+        }
+    }
+}
+
+static int compare_hash(const void* a, const void* b) {
+    uint64_t ha = *(const uint64_t*)a;
+    uint64_t hb = *(const uint64_t*)b;
+
+    return ha < hb ? -1 : ha > hb;
+}
+
+/* The distinct token hashes of str, sorted.  Returns how many. */
+static int hdrdb_tokens(const char* str, uint64_t* hashes) {
+    uint64_t hash;
+    int n = 0;
+    int i, j;
+
+    while(n < HDRDB_MAX_TOKENS && hdrdb_token(&str, &hash)) {
+        hashes[n++] = hash;
+    }
+    qsort(hashes, n, sizeof(uint64_t), compare_hash);
+    for(i = j = 0; i < n; i++) {
+        if(!j || hashes[i] != hashes[j - 1]) {
+            hashes[j++] = hashes[i];
+        }
+    }
+    return j;
+}
+
+static char* hdrdb_file(char* buf, size_t len, char* ext) {
+    snprintf(buf, len, "%s.%s", db.path, ext);
+    return buf;
+}
+
+static void hdrdb_unmap(void) {
+    if(db.hdrmap) {
+        munmap(db.hdrmap, db.hdrmaplen);
+        db.hdrmap = NULL;
+    }
+    if(db.strmap) {
+        munmap(db.strmap, db.strmaplen);
+        db.strmap = NULL;
+    }
+    if(db.idxmap) {
+        munmap(db.idxmap, db.idxmaplen);
+        db.idxmap = NULL;
+    }
+}
+
+static void* hdrdb_map_file(char* ext, size_t len) {
+    char name[1100];
+    void* map;
+    int fd;
+
+    if(!len || (fd = open(hdrdb_file(name, sizeof(name), ext), O_RDONLY)) < 0) {
+        return NULL;
+    }
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+/* Map the records, strings and index as of the current header */
+static int hdrdb_map(void) {
+    hdrdb_idx_header* ih;
+    char name[1100];
+    struct stat st;
+
+    hdrdb_unmap();
+    db.hdrmaplen = sizeof(hdrdb_header) + db.header.count * sizeof(hdrdb_record);
+    db.strmaplen = db.header.strsize;
+    if(!db.header.count) {
+        return NN_OK;
+    }
+    if((db.hdrmap = hdrdb_map_file("hdr", db.hdrmaplen)) == NULL
+    || (db.strmap = (char*)hdrdb_map_file("str", db.strmaplen)) == NULL) {
+        fprintf(stderr, "%s: cannot map %s: %s\n", __FUNCTION__, db.path, strerror(errno));
+        hdrdb_unmap();
+        return NN_ERROR;
+    }
+
+    db.indexed = 0;
+    if(stat(hdrdb_file(name, sizeof(name), "idx"), &st) == 0 && st.st_size >= sizeof(hdrdb_idx_header)
+    && (db.idxmap = hdrdb_map_file("idx", st.st_size)) != NULL) {
+        db.idxmaplen = st.st_size;
+        ih = (hdrdb_idx_header*)db.idxmap;
+        if(memcmp(ih->magic, HDRDB_IDX_MAGIC, 8) || ih->version != HDRDB_VERSION
+        || ih->records > db.header.count
+        || sizeof(hdrdb_idx_header) + ih->slots * sizeof(hdrdb_slot) + ih->npostings * sizeof(uint32_t) > db.idxmaplen) {
+            fprintf(stderr, "%s: ignoring bad index %s\n", __FUNCTION__, name);
+            munmap(db.idxmap, db.idxmaplen);
+            db.idxmap = NULL;
+        }
+        else {
+            db.indexed = ih->records;
+        }
+    }
+    return NN_OK;
+}
+
+static hdrdb_record* hdrdb_records(void) {
+    return (hdrdb_record*)((char*)db.hdrmap + sizeof(hdrdb_header));
+}
+
+/* Open the store of 'group' in 'dir', creating it when writable.  Only
+ * one writer at a time; readers never block. */
+int hdrdb_open(char* dir, char* group, int writable) {
+    char name[1100];
+    struct stat st;
+    int flags = writable ? O_RDWR | O_CREAT : O_RDONLY;
+    int rc;
+
+    if(writable && mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "%s: cannot create %s: %s\n", __FUNCTION__, dir, strerror(errno));
+        return NN_ERROR;
+    }
+    snprintf(db.path, sizeof(db.path), "%s/%s", dir, group);
+    db.writable = writable;
+    if((db.hdrfd = open(hdrdb_file(name, sizeof(name), "hdr"), flags, 0644)) < 0
+    || (db.strfd = open(hdrdb_file(name, sizeof(name), "str"), flags, 0644)) < 0) {
+        fprintf(stderr, "%s: cannot open %s: %s\n", __FUNCTION__, name, strerror(errno));
+        hdrdb_close();
+        return NN_ERROR;
+    }
+    if(writable && flock(db.hdrfd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "%s: %s is being updated by another process\n", __FUNCTION__, db.path);
+        hdrdb_close();
+        return NN_ERROR;
+    }
+
+    rc = pread(db.hdrfd, &db.header, sizeof(db.header), 0);
+    if(rc == 0 && writable) {
+        memset(&db.header, 0, sizeof(db.header));
+        memcpy(db.header.magic, HDRDB_MAGIC, 8);
+        db.header.version = HDRDB_VERSION;
+        if(pwrite(db.hdrfd, &db.header, sizeof(db.header), 0) != sizeof(db.header)) {
+            perror("pwrite");
+            hdrdb_close();
+            return NN_ERROR;
+        }
+    }
+    else if(rc != sizeof(db.header) || memcmp(db.header.magic, HDRDB_MAGIC, 8)
+         || db.header.version != HDRDB_VERSION) {
+        fprintf(stderr, "%s: %s is not a header database\n", __FUNCTION__, name);
+        hdrdb_close();
+        return NN_ERROR;
+    }
+
+    /* drop whatever a run that died appended after the last header write */
+    fstat(db.hdrfd, &st);
+    if(st.st_size < sizeof(hdrdb_header) + db.header.count * sizeof(hdrdb_record)) {
+        fprintf(stderr, "%s: %s is truncated\n", __FUNCTION__, db.path);
+        hdrdb_close();
+        return NN_ERROR;
+    }
+    if(writable) {
+        ftruncate(db.hdrfd, sizeof(hdrdb_header) + db.header.count * sizeof(hdrdb_record));
+        ftruncate(db.strfd, db.header.strsize);
+        return NN_OK;
+    }
+    return hdrdb_map();
+}
+
+unsigned long hdrdb_high_water(void) {
+    return db.header.high_water;
+}
+
+void hdrdb_set_high_water(unsigned long article) {
+    pthread_mutex_lock(&db.lock);
+    if(article > db.header.high_water) {
+        db.header.high_water = article;
+    }
+    pthread_mutex_unlock(&db.lock);
+}
+
+/* Append parsed overview headers, strings first */
+int hdrdb_append(index_header* hdrs, int n) {
+    hdrdb_record* recs;
+    char* strs;
+    size_t size = 0;
+    size_t off = 0;
+    size_t len;
+    int rc = NN_OK;
+    int i;
+
+    if(n <= 0) {
+        return NN_OK;
+    }
+    for(i = 0; i < n; i++) {
+        size += strlen(hdrs[i].subject) + strlen(hdrs[i].poster) + strlen(hdrs[i].msgid) + 3;
+    }
+    recs = (hdrdb_record*)malloc(n * sizeof(hdrdb_record));
+    strs = (char*)malloc(size);
+    if(!recs || !strs) {
+        perror("malloc");
+        free(recs);
+        free(strs);
+        return NN_ERROR;
+    }
+
+    pthread_mutex_lock(&db.lock);
+    for(i = 0; i < n; i++) {
+        recs[i].article = hdrs[i].article;
+        recs[i].bytes = hdrs[i].bytes;
+        recs[i].date = hdrs[i].date;
+        recs[i].subject = db.header.strsize + off;
+        len = strlen(hdrs[i].subject) + 1;
+        memcpy(strs + off, hdrs[i].subject, len);
+        off += len;
+        recs[i].poster = db.header.strsize + off;
+        len = strlen(hdrs[i].poster) + 1;
+        memcpy(strs + off, hdrs[i].poster, len);
+        off += len;
+        recs[i].msgid = db.header.strsize + off;
+        len = strlen(hdrs[i].msgid) + 1;
+        memcpy(strs + off, hdrs[i].msgid, len);
+        off += len;
+    }
+    if(pwrite(db.strfd, strs, size, db.header.strsize) != size
+    || pwrite(db.hdrfd, recs, n * sizeof(hdrdb_record),
+              sizeof(hdrdb_header) + db.header.count * sizeof(hdrdb_record)) != n * sizeof(hdrdb_record)) {
+        perror("pwrite");
+        rc = NN_ERROR;
+    }
+    else {
+        db.header.strsize += size;
+        db.header.count += n;
+    }
+    pthread_mutex_unlock(&db.lock);
+
+    free(recs);
+    free(strs);
+    return rc;
+}
+
+static int compare_pairs(const void* a, const void* b) {
+    const hdrdb_pair* pa = (const hdrdb_pair*)a;
+    const hdrdb_pair* pb = (const hdrdb_pair*)b;
+
+    if(pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    return pa->record < pb->record ? -1 : pa->record > pb->record;
+}
+
+/* Rebuild the .idx file over every record */
+static int hdrdb_build_index(void) {
+    hdrdb_record* recs = hdrdb_records();
+    hdrdb_idx_header ih;
+    hdrdb_pair* pairs = NULL;
+    hdrdb_pair* grown;
+    hdrdb_slot* slots;
+    uint32_t* postings;
+    uint64_t hashes[HDRDB_MAX_TOKENS];
+    size_t npairs = 0, maxpairs = 0;
+    size_t unique = 0;
+    size_t i, j, s;
+    char name[1100], tmp[1110];
+    FILE* fp;
+    int k, n;
+    unsigned long long start = trace_now();
+
+    for(i = 0; i < db.header.count; i++) {
+        n = hdrdb_tokens(db.strmap + recs[i].subject, hashes);
+        if(npairs + n > maxpairs) {
+            maxpairs = maxpairs ? maxpairs * 2 : 1 << 20;
+            if((grown = (hdrdb_pair*)realloc(pairs, maxpairs * sizeof(hdrdb_pair))) == NULL) {
+                perror("realloc");
+                free(pairs);
+                return NN_ERROR;
+            }
+            pairs = grown;
+        }
+        for(k = 0; k < n; k++) {
+            pairs[npairs].hash = hashes[k];
+            pairs[npairs++].record = i;
+        }
+    }
+    qsort(pairs, npairs, sizeof(hdrdb_pair), compare_pairs);
+    for(i = 0; i < npairs; i++) {
+        if(!i || pairs[i].hash != pairs[i - 1].hash) {
+            unique++;
+        }
+    }
+
+    memset(&ih, 0, sizeof(ih));
+    memcpy(ih.magic, HDRDB_IDX_MAGIC, 8);
+    ih.version = HDRDB_VERSION;
+    ih.records = db.header.count;
+    ih.npostings = npairs;
+    for(ih.slots = 16; ih.slots < unique * 2; ih.slots *= 2);
+    slots = (hdrdb_slot*)calloc(ih.slots, sizeof(hdrdb_slot));
+    postings = (uint32_t*)malloc((npairs ? npairs : 1) * sizeof(uint32_t));
+    if(!slots || !postings) {
+        perror("calloc");
+        free(pairs);
+        free(slots);
+        free(postings);
+        return NN_ERROR;
+    }
+    for(i = 0; i < npairs; i = j) {
+        for(s = pairs[i].hash & (ih.slots - 1); slots[s].hash; s = (s + 1) & (ih.slots - 1));
+        slots[s].hash = pairs[i].hash;
+        slots[s].offset = i;
+        for(j = i; j < npairs && pairs[j].hash == pairs[i].hash; j++) {
+            postings[j] = pairs[j].record;
+        }
+        slots[s].count = j - i;
+    }
+    free(pairs);
+
+    /* written aside and renamed over, so queries never see half an index */
+    hdrdb_file(name, sizeof(name), "idx");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    if((fp = fopen(tmp, "w")) == NULL
+    || fwrite(&ih, sizeof(ih), 1, fp) != 1
+    || fwrite(slots, sizeof(hdrdb_slot), ih.slots, fp) != ih.slots
+    || fwrite(postings, sizeof(uint32_t), npairs, fp) != npairs
+    || fclose(fp) != 0 || rename(tmp, name) != 0) {
+        fprintf(stderr, "%s: cannot write %s: %s\n", __FUNCTION__, tmp, strerror(errno));
+        free(slots);
+        free(postings);
+        return NN_ERROR;
+    }
+    free(slots);
+    free(postings);
+    db.indexed = db.header.count;
+    printf("%s: indexed %lu headers, %lu tokens in %.2f seconds\n", __FUNCTION__,
+        (unsigned long)db.header.count, (unsigned long)unique, (trace_now() - start) / 1e9);
+    return NN_OK;
+}
+
+/* Write the header and, when the unindexed tail has grown too long,
+ * rebuild the index.  Closes the store. */
+int hdrdb_close(void) {
+    int rc = NN_OK;
+    uint64_t delta;
+
+    if(db.writable && db.hdrfd >= 0 && db.strfd >= 0) {
+        fdatasync(db.strfd);
+        fdatasync(db.hdrfd);
+        if(pwrite(db.hdrfd, &db.header, sizeof(db.header), 0) != sizeof(db.header)) {
+            perror("pwrite");
+            rc = NN_ERROR;
+        }
+        else if(hdrdb_map() == NN_OK) {
+            delta = db.header.count - db.indexed;
+            if(delta && (delta > db.indexed / 8 || delta > HDRDB_DELTA_MAX)) {
+                rc = hdrdb_build_index();
+            }
+        }
+    }
+    hdrdb_unmap();
+    if(db.hdrfd >= 0) {
+        close(db.hdrfd);
+        db.hdrfd = -1;
+    }
+    if(db.strfd >= 0) {
+        close(db.strfd);
+        db.strfd = -1;
+    }
+    return rc;
+}
+
+/* Posting list of one token in the index, NULL if it has none */
+static uint32_t* hdrdb_postings(uint64_t hash, uint32_t* count) {
+    hdrdb_idx_header* ih = (hdrdb_idx_header*)db.idxmap;
+    hdrdb_slot* slots = (hdrdb_slot*)(ih + 1);
+    uint32_t* postings = (uint32_t*)(slots + ih->slots);
+    uint64_t s;
+
+    for(s = hash & (ih->slots - 1); slots[s].hash; s = (s + 1) & (ih->slots - 1)) {
+        if(slots[s].hash == hash) {
+            *count = slots[s].count;
+            return postings + slots[s].offset;
+        }
+    }
+    *count = 0;
+    return NULL;
+}
+
+/* Whether every query token is among the subject's */
+static int hdrdb_match(const char* subject, uint64_t* query, int nquery) {
+    uint64_t hashes[HDRDB_MAX_TOKENS];
+    int n = hdrdb_tokens(subject, hashes);
+    int i, j;
+
+    for(i = j = 0; i < nquery; i++) {
+        while(j < n && hashes[j] < query[i]) {
+            j++;
+        }
+        if(j == n || hashes[j] != query[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Records whose subjects contain every token of 'query', in record order.
+ * Returns how many, with the list in *matches, or NN_ERROR. */
+long hdrdb_search(char* query, uint32_t** matches) {
+    hdrdb_record* recs = hdrdb_records();
+    uint64_t hashes[HDRDB_MAX_TOKENS];
+    uint32_t* lists[HDRDB_MAX_TOKENS];
+    uint32_t counts[HDRDB_MAX_TOKENS];
+    uint32_t* out;
+    uint32_t* list;
+    uint32_t count, lo, hi, mid;
+    size_t n = 0, max;
+    size_t i, j;
+    int nquery;
+    int k, t;
+
+    *matches = NULL;
+    if((nquery = hdrdb_tokens(query, hashes)) == 0) {
+        fprintf(stderr, "%s: the query needs a word of two or more letters or digits\n", __FUNCTION__);
+        return NN_ERROR;
+    }
+    max = db.header.count - db.indexed;
+    for(k = 0; db.indexed && k < nquery; k++) {
+        lists[k] = hdrdb_postings(hashes[k], &counts[k]);
+    }
+
+    /* smallest list first, the others are only searched */
+    if(db.indexed) {
+        for(k = 1; k < nquery; k++) {
+            for(t = k; t > 0 && counts[t] < counts[t - 1]; t--) {
+                list = lists[t]; lists[t] = lists[t - 1]; lists[t - 1] = list;
+                count = counts[t]; counts[t] = counts[t - 1]; counts[t - 1] = count;
+            }
+        }
+        max += counts[0];
+    }
+    if((out = (uint32_t*)malloc((max ? max : 1) * sizeof(uint32_t))) == NULL) {
+        perror("malloc");
+        return NN_ERROR;
+    }
+
+    for(i = 0; db.indexed && i < counts[0]; i++) {
+        for(k = 1; k < nquery; k++) {
+            /* candidates ascend, so each search gallops on from where
+             * the last one ended */
+            for(hi = 1; hi < counts[k] && lists[k][hi] < lists[0][i]; hi *= 2);
+            lo = hi / 2;
+            if(hi > counts[k]) {
+                hi = counts[k];
+            }
+            while(lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if(lists[k][mid] < lists[0][i]) {
+                    lo = mid + 1;
+                }
+                else {
+                    hi = mid;
+                }
+            }
+            lists[k] += lo;
+            counts[k] -= lo;
+            if(!counts[k] || lists[k][0] != lists[0][i]) {
+                break;
+            }
+        }
+        if(k == nquery) {
+            out[n++] = lists[0][i];
+        }
+    }
+    for(j = db.indexed; j < db.header.count; j++) {
+        if(hdrdb_match(db.strmap + recs[j].subject, hashes, nquery)) {
+            out[n++] = j;
+        }
+    }
+    *matches = out;
+    return n;
+}
+
+/* Search the store of 'group' and turn the matching posts into a file
+ * list, as parse_nzb() would from an NZB of them */
+file_node* hdrdb_file_list(char* dir, char* group, char* query) {
+    index_header hdrs[HDRDB_BATCH];
+    hdrdb_record* rec;
+    uint32_t* matches;
+    unsigned long long start;
+    long n;
+    long i;
+    int k = 0;
+
+    if(hdrdb_open(dir, group, 0) < 0) {
+        return NULL;
+    }
+    if(!db.header.count) {
+        fprintf(stderr, "%s: no headers for %s in %s\n", __FUNCTION__, group, dir);
+        hdrdb_close();
+        return NULL;
+    }
+    start = trace_now();
+    if((n = hdrdb_search(query, &matches)) < 0) {
+        hdrdb_close();
+        return NULL;
+    }
+    printf("%s: %ld of %lu headers match \"%s\" (%.2f ms)\n", __FUNCTION__, n,
+        (unsigned long)db.header.count, query, (trace_now() - start) / 1e6);
+
+    /* the strings are copied out of the mapping by index_add() */
+    for(i = 0; i < n; i++) {
+        rec = &hdrdb_records()[matches[i]];
+        hdrs[k].article = rec->article;
+        hdrs[k].bytes = rec->bytes;
+        hdrs[k].date = rec->date;
+        hdrs[k].subject = db.strmap + rec->subject;
+        hdrs[k].poster = db.strmap + rec->poster;
+        hdrs[k].msgid = db.strmap + rec->msgid;
+        if(++k == HDRDB_BATCH || i == n - 1) {
+            index_add(hdrs, k);
+            k = 0;
+        }
+    }
+    free(matches);
+    hdrdb_close();
+    return index_file_list(group);
+}
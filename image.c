@@ -0,0 +1,353 @@
+/* Precompiled job images.
+ *
+ * Parsing a large NZB is slow: libxml2 builds the whole document, every
+ * file needs its md5 name and every node its own allocation.  After the
+ * first parse the file list is written to <outdir>/.<hash>.nzbimg, keyed
+ * by a hash of the NZB's contents, and later runs on the same NZB map the
+ * image instead of parsing it:
+ *
+ *  header      magic, version, the NZB's hash and size, table sizes and a
+ *              CRC32 of everything after the header
+ *  files       one fixed-size record each, with the index of its first
+ *              segment and its segment count
+ *  segments    one fixed-size record each, the files' segments in order
+ *  strings     NUL-terminated, referenced by offset from the records
+ *
+ * The nodes are built from the tables with one allocation for all the
+ * files and one for all the segments, which del_file_list() leaves to
+ * image_cleanup().  An image that does not check out in every respect is
+ * ignored and rewritten.  Images are written to a temporary name and
+ * renamed into place, so a reader only ever sees a complete one.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nzbnews.h"
+
+#define IMAGE_MAGIC         "NZBNIMG1"
+#define IMAGE_VERSION       1
+
+typedef struct _image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t crc32;             /* of the tables and strings */
+    uint64_t nzb_hash;
+    uint64_t nzb_size;
+    uint32_t nfiles;
+    uint32_t nsegments;
+    uint64_t strsize;
+} image_header;
+
+typedef struct _image_file {
+    uint32_t poster;            /* offsets into the strings */
+    uint32_t group;
+    uint32_t subject;
+    uint32_t filename;
+    int64_t date;
+    uint32_t first;             /* first segment */
+    uint32_t nsegments;
+} image_file;
+
+typedef struct _image_segment {
+    uint32_t msgid;
+    uint32_t bytes;
+    uint32_t number;
+} image_segment;
+
+typedef struct _image_block {
+    file_node* files;
+    uint32_t nfiles;
+    segment_node* segments;
+    uint32_t nsegments;
+} image_block;
+
+static struct _image_t {
+    pthread_mutex_t lock;
+    image_block* blocks;
+    int nblocks;
+} img = { PTHREAD_MUTEX_INITIALIZER };
+
+/* FNV-1a over the NZB's contents, with its size.  Returns NN_ERROR if it
+ * cannot be read. */
+static int image_key(char* nzbfile, uint64_t* hash, uint64_t* size) {
+    struct stat finfo;
+    unsigned char* map;
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    int fd;
+
+    if((fd = open(nzbfile, O_RDONLY)) == -1 || fstat(fd, &finfo) != 0 || !finfo.st_size) {
+        if(fd != -1) {
+            close(fd);
+        }
+        return NN_ERROR;
+    }
+    map = mmap(NULL, finfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return NN_ERROR;
+    }
+    for(i = 0; i < finfo.st_size; i++) {
+        h = (h ^ map[i]) * 1099511628211ULL;
+    }
+    munmap(map, finfo.st_size);
+    *hash = h;
+    *size = finfo.st_size;
+    return NN_OK;
+}
+
+static void image_path(char* path, size_t len, uint64_t hash) {
+    snprintf(path, len, "%s/.%016llx.nzbimg", g.outdir, (unsigned long long)hash);
+}
+
+/* Whether a node came from an image, so del_file_list() must not free it */
+int image_owns(void* node) {
+    char* p = (char*)node;
+    int ret = 0;
+    int i;
+
+    pthread_mutex_lock(&img.lock);
+    for(i = 0; i < img.nblocks && !ret; i++) {
+        ret = (p >= (char*)img.blocks[i].files && p < (char*)(img.blocks[i].files + img.blocks[i].nfiles))
+           || (p >= (char*)img.blocks[i].segments && p < (char*)(img.blocks[i].segments + img.blocks[i].nsegments));
+    }
+    pthread_mutex_unlock(&img.lock);
+    return ret;
+}
+
+/* Build the file list for nzbfile from its image.  Returns NULL if there
+ * is no usable image. */
+file_node* image_load(char* nzbfile) {
+    char path[1024];
+    struct stat finfo;
+    unsigned char* map;
+    image_header* h;
+    image_file* files;
+    image_segment* segs;
+    char* strings;
+    file_node* fnodes = NULL;
+    segment_node* snodes = NULL;
+    image_block* blocks;
+    uint64_t hash, size;
+    size_t len;
+    uint32_t i, k;
+    int fd;
+
+    if(image_key(nzbfile, &hash, &size) < 0) {
+        return NULL;
+    }
+    image_path(path, sizeof(path), hash);
+    if((fd = open(path, O_RDONLY)) == -1) {
+        return NULL;
+    }
+    if(fstat(fd, &finfo) != 0 || finfo.st_size < sizeof(image_header)
+    || (map = mmap(NULL, finfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    h = (image_header*)map;
+    files = (image_file*)(map + sizeof(image_header));
+    segs = (image_segment*)(files + h->nfiles);
+    strings = (char*)(segs + h->nsegments);
+    len = finfo.st_size - sizeof(image_header);
+    if(memcmp(h->magic, IMAGE_MAGIC, 8) || h->version != IMAGE_VERSION
+    || h->nzb_hash != hash || h->nzb_size != size || !h->nfiles || !h->strsize
+    || (uint64_t)h->nfiles * sizeof(image_file) + (uint64_t)h->nsegments * sizeof(image_segment)
+        + h->strsize != len
+    || strings[h->strsize - 1] != '\0'
+    || crc32_update(0, map + sizeof(image_header), len) != h->crc32) {
+        fprintf(stderr, "%s: ignoring bad image [%s]\n", __FUNCTION__, path);
+        munmap(map, finfo.st_size);
+        return NULL;
+    }
+    for(i = 0; i < h->nfiles; i++) {
+        if(files[i].poster >= h->strsize || files[i].group >= h->strsize
+        || files[i].subject >= h->strsize || files[i].filename >= h->strsize
+        || (uint64_t)files[i].first + files[i].nsegments > h->nsegments) {
+            break;
+        }
+        for(k = files[i].first; k < files[i].first + files[i].nsegments && segs[k].msgid < h->strsize; k++);
+        if(k < files[i].first + files[i].nsegments) {
+            break;
+        }
+    }
+    if(i < h->nfiles) {
+        fprintf(stderr, "%s: ignoring bad image [%s]\n", __FUNCTION__, path);
+        munmap(map, finfo.st_size);
+        return NULL;
+    }
+
+    if((fnodes = (file_node*)calloc(h->nfiles, sizeof(file_node))) == NULL
+    || (snodes = (segment_node*)calloc(h->nsegments ? h->nsegments : 1, sizeof(segment_node))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for(i = 0; i < h->nfiles; i++) {
+        file_node* file = &fnodes[i];
+
+        strncpy(file->poster, strings + files[i].poster, sizeof(file->poster) - 1);
+        strncpy(file->group, strings + files[i].group, sizeof(file->group) - 1);
+        strncpy(file->subject, strings + files[i].subject, sizeof(file->subject) - 1);
+        strncpy(file->filename, strings + files[i].filename, sizeof(file->filename) - 1);
+        file->date = files[i].date;
+        file->next = i + 1 < h->nfiles ? &fnodes[i + 1] : NULL;
+        file->segments = files[i].nsegments ? &snodes[files[i].first] : NULL;
+        for(k = files[i].first; k < files[i].first + files[i].nsegments; k++) {
+            segment_node* segment = &snodes[k];
+
+            segment->file = file;
+            segment->bytes = segs[k].bytes;
+            segment->number = segs[k].number;
+            strncpy(segment->msgid, strings + segs[k].msgid, sizeof(segment->msgid) - 1);
+            segment->next = k + 1 < files[i].first + files[i].nsegments ? &snodes[k + 1] : NULL;
+        }
+    }
+
+    pthread_mutex_lock(&img.lock);
+    if((blocks = (image_block*)realloc(img.blocks, (img.nblocks + 1) * sizeof(image_block))) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    img.blocks = blocks;
+    img.blocks[img.nblocks].files = fnodes;
+    img.blocks[img.nblocks].nfiles = h->nfiles;
+    img.blocks[img.nblocks].segments = snodes;
+    img.blocks[img.nblocks].nsegments = h->nsegments;
+    img.nblocks++;
+    pthread_mutex_unlock(&img.lock);
+
+    DEBUG("%s: %u files, %u segments from [%s]\n", __FUNCTION__, h->nfiles, h->nsegments, path);
+    munmap(map, finfo.st_size);
+    return fnodes;
+}
+
+/* Append str to the string pool.  Returns its offset. */
+static uint32_t image_string(char** pool, size_t* used, size_t* max, char* str) {
+    size_t len = strlen(str) + 1;
+    uint32_t offset = *used;
+    char* bigger;
+
+    if(*used + len > *max) {
+        *max = (*max + len) * 2;
+        if((bigger = (char*)realloc(*pool, *max)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        *pool = bigger;
+    }
+    memcpy(*pool + *used, str, len);
+    *used += len;
+    return offset;
+}
+
+/* Write the image of a freshly parsed list */
+int image_write(char* nzbfile, file_node* list) {
+    char path[1024];
+    char tmp[1100];
+    image_header h;
+    image_file* files = NULL;
+    image_segment* segs = NULL;
+    char* pool = NULL;
+    size_t used = 0;
+    size_t max = 0;
+    file_node* file;
+    segment_node* segment;
+    uint32_t nfiles = 0;
+    uint32_t nsegments = 0;
+    uint32_t i, k;
+    unsigned long crc;
+    FILE* fp;
+    int ret = NN_OK;
+
+    memset(&h, 0, sizeof(h));
+    if(!list || image_key(nzbfile, &h.nzb_hash, &h.nzb_size) < 0) {
+        return NN_ERROR;
+    }
+    for(file = list; file; file = file->next) {
+        nfiles++;
+        for(segment = file->segments; segment; segment = segment->next) {
+            nsegments++;
+        }
+    }
+    if((files = (image_file*)calloc(nfiles, sizeof(image_file))) == NULL
+    || (segs = (image_segment*)calloc(nsegments ? nsegments : 1, sizeof(image_segment))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for(file = list, i = 0, k = 0; file; file = file->next, i++) {
+        files[i].poster = image_string(&pool, &used, &max, file->poster);
+        files[i].group = image_string(&pool, &used, &max, file->group);
+        files[i].subject = image_string(&pool, &used, &max, file->subject);
+        files[i].filename = image_string(&pool, &used, &max, file->filename);
+        files[i].date = file->date;
+        files[i].first = k;
+        for(segment = file->segments; segment; segment = segment->next, k++) {
+            segs[k].msgid = image_string(&pool, &used, &max, segment->msgid);
+            segs[k].bytes = segment->bytes;
+            segs[k].number = segment->number;
+        }
+        files[i].nsegments = k - files[i].first;
+    }
+
+    memcpy(h.magic, IMAGE_MAGIC, 8);
+    h.version = IMAGE_VERSION;
+    h.nfiles = nfiles;
+    h.nsegments = nsegments;
+    h.strsize = used;
+    crc = crc32_update(0, (unsigned char*)files, nfiles * sizeof(image_file));
+    crc = crc32_update(crc, (unsigned char*)segs, nsegments * sizeof(image_segment));
+    crc = crc32_update(crc, (unsigned char*)pool, used);
+    h.crc32 = crc;
+
+    if(mkdir(g.outdir, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir");
+        ret = NN_ERROR;
+    }
+    image_path(path, sizeof(path), h.nzb_hash);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if(ret == NN_OK && (fp = fopen(tmp, "w")) != NULL) {
+        if(fwrite(&h, sizeof(h), 1, fp) != 1
+        || fwrite(files, sizeof(image_file), nfiles, fp) != nfiles
+        || fwrite(segs, sizeof(image_segment), nsegments, fp) != nsegments
+        || fwrite(pool, 1, used, fp) != used) {
+            ret = NN_ERROR;
+        }
+        if(fclose(fp) != 0 || ret != NN_OK || rename(tmp, path) != 0) {
+            perror("image_write");
+            unlink(tmp);
+            ret = NN_ERROR;
+        }
+    }
+    else if(ret == NN_OK) {
+        perror("fopen");
+        ret = NN_ERROR;
+    }
+    free(files);
+    free(segs);
+    free(pool);
+    return ret;
+}
+
+/* Free the nodes of every image loaded */
+void image_cleanup(void) {
+    int i;
+
+    pthread_mutex_lock(&img.lock);
+    for(i = 0; i < img.nblocks; i++) {
+        free(img.blocks[i].files);
+        free(img.blocks[i].segments);
+    }
+    free(img.blocks);
+    img.blocks = NULL;
+    img.nblocks = 0;
+    pthread_mutex_unlock(&img.lock);
+}
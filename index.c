@@ -0,0 +1,822 @@
+/* Group overview indexer.
+ *
+ * With -G the article range of a group is split into chunks that the
+ * connections fetch in parallel with XZVER (yEnc-wrapped deflate) when the
+ * server has it, else XOVER.  Overview lines are split in place, with the
+ * fields left pointing into the receive buffer, and each chunk is merged
+ * into a table of files keyed by poster and subject with the (part/total)
+ * counter taken out.  Strings that outlive the buffer go into an arena.
+ * The result is written as an NZB, or with -D the headers are appended to
+ * the local header database instead (hdrdb.c), which later turns search
+ * results into a file list through the same table.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "nzbnews.h"
+
+#define INDEX_CHUNK         20000       /* articles per OVER request */
+#define INDEX_BUCKETS       (1 << 16)   /* initial file table size */
+#define INDEX_ARENA         (1 << 20)
+#define INDEX_RETRIES       3
+
+typedef struct _ix_part {
+    struct _ix_part* next;
+    unsigned long article;
+    unsigned long bytes;
+    unsigned int number;
+    char* msgid;
+} ix_part;
+
+typedef struct _ix_file {
+    struct _ix_file* hnext;
+    unsigned long long hash;
+    char* subject;              /* with the part counter reset to 1 */
+    char* poster;
+    time_t date;
+    unsigned int total;
+    unsigned int nparts;
+    ix_part* parts;
+} ix_file;
+
+typedef struct _ix_arena {
+    struct _ix_arena* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ix_arena;
+
+static struct _index_t {
+    pthread_mutex_t lock;
+    char* group;
+    unsigned long next;         /* first article of the next chunk */
+    unsigned long last;
+    unsigned long chunk;
+    int xzver;                  /* -1 untested, 0 unsupported, 1 in use */
+    ix_file** buckets;
+    unsigned long nbuckets;
+    unsigned long nfiles;
+    ix_arena* arena;
+    unsigned long headers;
+    unsigned long parts;
+    unsigned long failed;       /* chunks given up on */
+    unsigned long lowfail;      /* first article of the lowest of them */
+} ix = { PTHREAD_MUTEX_INITIALIZER };
+
+static char* arena_alloc(size_t len) {
+    ix_arena* a = ix.arena;
+    size_t size;
+
+    len = (len + 7) & ~(size_t)7;
+    if(!a || a->used + len > a->size) {
+        size = len > INDEX_ARENA ? len : INDEX_ARENA;
+        if((a = (ix_arena*)malloc(sizeof(ix_arena) + size)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        a->used = 0;
+        a->size = size;
+        a->next = ix.arena;
+        ix.arena = a;
+    }
+    a->used += len;
+    return a->data + a->used - len;
+}
+
+static char* arena_strdup(char* str, size_t len) {
+    char* p = arena_alloc(len + 1);
+
+    memcpy(p, str, len);
+    p[len] = '\0';
+    return p;
+}
+
+static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+/* Parse an RFC 5322 date such as "Mon, 1 Jan 2024 00:00:00 +0100" */
+time_t index_date(char* str) {
+    int day, year, hh = 0, mm = 0, ss = 0;
+    int mon;
+    int tz = 0;
+    char mname[4];
+    char zone[8] = "";
+    const char* m;
+    long days;
+    int y;
+
+    if((m = strchr(str, ',')) != NULL) {
+        str = (char*)m + 1;
+    }
+    if(sscanf(str, "%d %3s %d %d:%d:%d %7s", &day, mname, &year, &hh, &mm, &ss, zone) < 3
+    || strlen(mname) != 3) {
+        return 0;
+    }
+    for(mon = 0; mon < 12 && strncasecmp(months + 3 * mon, mname, 3); mon++);
+    if(mon == 12) {
+        return 0;
+    }
+    if(year < 100) {
+        year += year < 70 ? 2000 : 1900;
+    }
+    if((zone[0] == '+' || zone[0] == '-') && strlen(zone) == 5) {
+        tz = ((zone[1] - '0') * 10 + zone[2] - '0') * 3600 + ((zone[3] - '0') * 10 + zone[4] - '0') * 60;
+        tz = zone[0] == '-' ? -tz : tz;
+    }
+
+    /* days from the epoch to the civil date */
+    y = year - (mon < 2);
+    days = 365L * y + y / 4 - y / 100 + y / 400
+         + (153 * (mon + (mon < 2 ? 10 : -2)) + 2) / 5 + day - 1 - 719468;
+    return (time_t)(days * 86400 + hh * 3600 + mm * 60 + ss - tz);
+}
+
+/* Split one overview line in place.  Returns 0 and fills 'h' with pointers
+ * into the line, or NN_ERROR if the line is short. */
+static int index_split(char* line, char* end, index_header* h) {
+    char* field[8];
+    char* p = line;
+    int n = 0;
+
+    while(n < 8) {
+        field[n++] = p;
+        if((p = memchr(p, '\t', end - p)) == NULL) {
+            break;
+        }
+        *p++ = '\0';
+    }
+    if(n < 7) {
+        return NN_ERROR;
+    }
+    *end = '\0';
+    h->article = strtoul(field[0], NULL, 10);
+    h->subject = field[1];
+    h->poster = field[2];
+    h->date = index_date(field[3]);
+    h->msgid = field[4];
+    h->bytes = strtoul(field[6], NULL, 10);
+    if(*h->msgid == '<') {
+        h->msgid++;
+    }
+    if((p = strchr(h->msgid, '>')) != NULL) {
+        *p = '\0';
+    }
+    return NN_OK;
+}
+
+/* Split the dot-unstuffed body of an overview response into headers.  The
+ * strings are left in buf.  Returns the number of headers, or NN_ERROR. */
+int index_parse(char* buf, size_t len, index_header** hdrs, size_t* max) {
+    index_header* grown;
+    char* p = buf;
+    char* end = buf + len;
+    char* eol;
+    size_t n = 0;
+
+    while(p < end) {
+        if((eol = memchr(p, '\n', end - p)) == NULL) {
+            eol = end;
+        }
+        if(n == *max) {
+            *max = *max ? *max * 2 : 4096;
+            if((grown = (index_header*)realloc(*hdrs, *max * sizeof(index_header))) == NULL) {
+                perror("realloc");
+                return NN_ERROR;
+            }
+            *hdrs = grown;
+        }
+        if(index_split(p, eol > p && eol[-1] == '\r' ? eol - 1 : eol, &(*hdrs)[n]) == NN_OK) {
+            n++;
+        }
+        p = eol + 1;
+    }
+    return n;
+}
+
+/* Find the last "(n/m)" in a subject.  Returns its '(' or NULL. */
+char* index_counter(char* subject, unsigned int* part, unsigned int* total) {
+    char* p = subject + strlen(subject);
+    char* close;
+
+    while(p > subject) {
+        if(*--p != '(') {
+            continue;
+        }
+        if(sscanf(p, "(%u/%u", part, total) == 2
+        && (close = strchr(p, ')')) != NULL
+        && strspn(p + 1, "0123456789/") == close - p - 1) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void index_grow(void) {
+    ix_file** buckets;
+    ix_file* f;
+    unsigned long size = ix.nbuckets * 2;
+    unsigned long i;
+
+    if((buckets = (ix_file**)calloc(size, sizeof(ix_file*))) == NULL) {
+        return;     /* keep the longer chains */
+    }
+    for(i = 0; i < ix.nbuckets; i++) {
+        while((f = ix.buckets[i]) != NULL) {
+            ix.buckets[i] = f->hnext;
+            f->hnext = buckets[f->hash & (size - 1)];
+            buckets[f->hash & (size - 1)] = f;
+        }
+    }
+    free(ix.buckets);
+    ix.buckets = buckets;
+    ix.nbuckets = size;
+}
+
+/* Merge parsed headers into the file table.  Headers without a part
+ * counter are not binary posts and are skipped. */
+void index_add(index_header* hdrs, int n) {
+    char key[1024];
+    unsigned long long hash;
+    unsigned int part, total;
+    ix_file* f;
+    ix_part* pt;
+    char* c;
+    int len;
+    int i;
+
+    pthread_mutex_lock(&ix.lock);
+    if(!ix.buckets) {
+        ix.nbuckets = INDEX_BUCKETS;
+        if((ix.buckets = (ix_file**)calloc(ix.nbuckets, sizeof(ix_file*))) == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    for(i = 0; i < n; i++) {
+        ix.headers++;
+        if((c = index_counter(hdrs[i].subject, &part, &total)) == NULL || !part || !total) {
+            continue;
+        }
+        len = snprintf(key, sizeof(key), "%s\t%.*s(1/%u)%s", hdrs[i].poster,
+            (int)(c - hdrs[i].subject), hdrs[i].subject, total, strchr(c, ')') + 1);
+        if(len >= sizeof(key)) {
+            continue;
+        }
+        hash = cache_hash(key);
+        for(f = ix.buckets[hash & (ix.nbuckets - 1)]; f; f = f->hnext) {
+            if(f->hash == hash && !strcmp(f->poster, hdrs[i].poster)
+            && !strcmp(f->subject, strchr(key, '\t') + 1)) {
+                break;
+            }
+        }
+        if(!f) {
+            f = (ix_file*)arena_alloc(sizeof(ix_file));
+            memset(f, 0, sizeof(ix_file));
+            f->hash = hash;
+            f->poster = arena_strdup(hdrs[i].poster, strlen(hdrs[i].poster));
+            c = strchr(key, '\t') + 1;
+            f->subject = arena_strdup(c, len - (c - key));
+            f->date = hdrs[i].date;
+            f->total = total;
+            f->hnext = ix.buckets[hash & (ix.nbuckets - 1)];
+            ix.buckets[hash & (ix.nbuckets - 1)] = f;
+            if(++ix.nfiles > ix.nbuckets) {
+                index_grow();
+            }
+        }
+        pt = (ix_part*)arena_alloc(sizeof(ix_part));
+        pt->article = hdrs[i].article;
+        pt->bytes = hdrs[i].bytes;
+        pt->number = part;
+        pt->msgid = arena_strdup(hdrs[i].msgid, strlen(hdrs[i].msgid));
+        pt->next = f->parts;
+        f->parts = pt;
+        f->nparts++;
+        ix.parts++;
+    }
+    pthread_mutex_unlock(&ix.lock);
+}
+
+/* Send 'cmd' and read a multi-line response into *buf, growing it as
+ * needed.  On success the dot-unstuffed body, without the status line, is
+ * at *body.  Returns the NNTP status or an NN_* error. */
+static int index_fetch(int* sock, char* cmd, char** buf, size_t* buflen, char** body, size_t* len) {
+    char* grown;
+    char* eol;
+    size_t used = 0;
+    int bytes;
+    int rc;
+
+    if(send_msg(*sock, cmd, strlen(cmd), 0) < 0) {
+        return NN_ERROR;
+    }
+    for(;;) {
+        if(*buflen - used < 65536) {
+            if((grown = (char*)realloc(*buf, *buflen * 2)) == NULL) {
+                perror("realloc");
+                return NN_ERROR;
+            }
+            *buf = grown;
+            *buflen *= 2;
+        }
+        if((bytes = recv_msg(*sock, *buf + used, *buflen - used - 1, 0)) <= 0) {
+            return bytes == NN_TIMEOUT ? NN_TIMEOUT : NN_ERROR;
+        }
+        used += bytes;
+        (*buf)[used] = '\0';
+        if((eol = memchr(*buf, '\n', used)) == NULL) {
+            continue;
+        }
+        if((rc = check_response_status(*buf)) != NNTP_OVERVIEW_OK) {
+            return rc;
+        }
+        if(find_terminator(*buf, used, used - bytes)) {
+            break;
+        }
+    }
+    eol++;
+    *body = eol;
+    *len = remove_dots(eol, used - (eol - *buf), eol, used - (eol - *buf));
+    return NNTP_OVERVIEW_OK;
+}
+
+/* Undo XZVER: a yEnc-encoded deflate stream, raw or with a zlib header */
+static int index_inflate(char* src, size_t len, char** out, size_t* outlen) {
+    unsigned char* packed;
+    yenc_info info;
+    z_stream z;
+    char* grown;
+    int packedlen;
+    int rc = Z_DATA_ERROR;
+    int wbits;
+
+    if((packed = (unsigned char*)malloc(len)) == NULL) {
+        return NN_ERROR;
+    }
+    if((packedlen = yenc_decode(src, len, packed, len, &info)) < 0) {
+        free(packed);
+        return NN_ERROR;
+    }
+    for(wbits = -15; wbits <= 15 && rc != Z_STREAM_END; wbits += 30) {
+        memset(&z, 0, sizeof(z));
+        if(inflateInit2(&z, wbits) != Z_OK) {
+            break;
+        }
+        z.next_in = packed;
+        z.avail_in = packedlen;
+        do {
+            if(z.total_out + 65536 > *outlen) {
+                if((grown = (char*)realloc(*out, *outlen * 2)) == NULL) {
+                    rc = Z_MEM_ERROR;
+                    break;
+                }
+                *out = grown;
+                *outlen *= 2;
+            }
+            z.next_out = (unsigned char*)*out + z.total_out;
+            z.avail_out = *outlen - z.total_out - 1;
+            rc = inflate(&z, Z_NO_FLUSH);
+        } while(rc == Z_OK);
+        inflateEnd(&z);
+    }
+    free(packed);
+    return rc == Z_STREAM_END ? (int)z.total_out : NN_ERROR;
+}
+
+/* GROUP that also returns the article range */
+int index_range(int* sock, char* group, unsigned long* first, unsigned long* last) {
+    char buf[1024];
+    unsigned long count;
+    int bytes;
+
+    snprintf(buf, sizeof(buf), "GROUP %s\r\n", group);
+    if(send_msg(*sock, buf, strlen(buf), 0) < 0
+    || (bytes = recv_msg(*sock, buf, sizeof(buf) - 1, 0)) <= 0) {
+        fprintf(stderr, "%s: error sending GROUP command\n", __FUNCTION__);
+        return NN_ERROR;
+    }
+    buf[bytes] = '\0';
+    if(sscanf(buf, "211 %lu %lu %lu", &count, first, last) != 3) {
+        fprintf(stderr, "%s: unexpected response to GROUP command [%s]\n", __FUNCTION__, buf);
+        return NN_ERROR;
+    }
+    return NN_OK;
+}
+
+/* Fetch and merge one chunk of the range */
+static int index_chunk(int* sock, unsigned long lo, unsigned long hi,
+    char** buf, size_t* buflen, char** zbuf, size_t* zbuflen,
+    index_header** hdrs, size_t* maxhdrs) {
+    char cmd[128];
+    char* body;
+    size_t len;
+    int xzver;
+    int rc;
+    int n;
+
+    xzver = __atomic_load_n(&ix.xzver, __ATOMIC_RELAXED);
+    if(xzver) {
+        snprintf(cmd, sizeof(cmd), "XZVER %lu-%lu\r\n", lo, hi);
+        rc = index_fetch(sock, cmd, buf, buflen, &body, &len);
+        if(rc == NNTP_OVERVIEW_OK && (n = index_inflate(body, len, zbuf, zbuflen)) >= 0) {
+            __atomic_store_n(&ix.xzver, 1, __ATOMIC_RELAXED);
+            body = *zbuf;
+            len = n;
+        }
+        else if(rc == NNTP_NO_ARTICLE_SELECTED || rc == NNTP_NO_ARTICLES_IN_RANGE) {
+            return NN_OK;   /* an expired stretch of the range */
+        }
+        else if(rc == NNTP_NOT_RECOGNIZED || rc == NNTP_SYNTAX || rc == NNTP_ACCESS
+             || (rc == NNTP_OVERVIEW_OK && xzver < 0)) {
+            printf("%s: XZVER not available, using XOVER\n", __FUNCTION__);
+            __atomic_store_n(&ix.xzver, 0, __ATOMIC_RELAXED);
+            xzver = 0;
+        }
+        else {
+            return rc < 0 ? rc : NN_ERROR;
+        }
+    }
+    if(!xzver) {
+        snprintf(cmd, sizeof(cmd), "XOVER %lu-%lu\r\n", lo, hi);
+        rc = index_fetch(sock, cmd, buf, buflen, &body, &len);
+        if(rc == NNTP_NO_ARTICLE_SELECTED || rc == NNTP_NO_ARTICLES_IN_RANGE) {
+            return NN_OK;   /* an expired stretch of the range */
+        }
+        if(rc != NNTP_OVERVIEW_OK) {
+            return rc < 0 ? rc : NN_ERROR;
+        }
+    }
+    if((n = index_parse(body, len, hdrs, maxhdrs)) < 0) {
+        return NN_ERROR;
+    }
+    if(g.header_db) {
+        __sync_fetch_and_add(&ix.headers, n);
+        if(hdrdb_append(*hdrs, n) < 0) {
+            return NN_ERROR;
+        }
+    }
+    else {
+        index_add(*hdrs, n);
+    }
+    DEBUG("%s: %lu-%lu: %d headers\n", __FUNCTION__, lo, hi, n);
+    return NN_OK;
+}
+
+static void* index_thread(void* arg) {
+    connection* conn = (connection*)arg;
+    index_header* hdrs = NULL;
+    size_t maxhdrs = 0;
+    size_t buflen = 1 << 20;
+    size_t zbuflen = 1 << 20;
+    char* buf = (char*)malloc(buflen);
+    char* zbuf = (char*)malloc(zbuflen);
+    unsigned long lo, hi;
+    unsigned long first, last;
+    int tries;
+    char name[32];
+
+    snprintf(name, sizeof(name), "index %d", conn->id);
+    trace_thread_name(name);
+    if(!buf || !zbuf) {
+        perror("malloc");
+        exit(1);
+    }
+
+    while(g.running) {
+        pthread_mutex_lock(&ix.lock);
+        lo = ix.next;
+        hi = lo + ix.chunk - 1 < ix.last ? lo + ix.chunk - 1 : ix.last;
+        ix.next = hi + 1;
+        pthread_mutex_unlock(&ix.lock);
+        if(lo > hi || lo > ix.last) {
+            break;
+        }
+
+        for(tries = 0; tries < INDEX_RETRIES && g.running; tries++) {
+            if(conn->sock == -1) {
+                if((conn->sock = server_connect(conn->server, 3)) == -1
+                || index_range(&conn->sock, ix.group, &first, &last) < 0) {
+                    if(conn->sock != -1) {
+                        server_disconnect(&conn->sock);
+                    }
+                    sleep(1);
+                    continue;
+                }
+            }
+            if(index_chunk(&conn->sock, lo, hi, &buf, &buflen, &zbuf, &zbuflen, &hdrs, &maxhdrs) == NN_OK) {
+                break;
+            }
+            fprintf(stderr, "%s: [%d] chunk %lu-%lu failed, retrying\n", __FUNCTION__, conn->id, lo, hi);
+            server_disconnect(&conn->sock);
+            conn->sock = -1;
+        }
+        if(tries == INDEX_RETRIES) {
+            pthread_mutex_lock(&ix.lock);
+            if(!ix.failed++ || lo < ix.lowfail) {
+                ix.lowfail = lo;
+            }
+            pthread_mutex_unlock(&ix.lock);
+        }
+    }
+
+    if(conn->sock != -1) {
+        server_disconnect(&conn->sock);
+    }
+    free(hdrs);
+    free(buf);
+    free(zbuf);
+    return NULL;
+}
+
+static void xml_escape(FILE* fp, char* str) {
+    for(; *str; str++) {
+        switch(*str) {
+        case '&':   fputs("&amp;", fp); break;
+        case '<':   fputs("&lt;", fp); break;
+        case '>':   fputs("&gt;", fp); break;
+        case '"':   fputs("&quot;", fp); break;
+        default:
+            if((unsigned char)*str >= 0x20 || *str == '\t') {
+                fputc(*str, fp);
+            }
+            break;
+        }
+    }
+}
+
+static int compare_parts(const void* a, const void* b) {
+    const ix_part* pa = *(const ix_part**)a;
+    const ix_part* pb = *(const ix_part**)b;
+
+    if(pa->number != pb->number) {
+        return pa->number < pb->number ? -1 : 1;
+    }
+    return pa->article < pb->article ? -1 : pa->article > pb->article;
+}
+
+static int compare_ix_files(const void* a, const void* b) {
+    const ix_file* fa = *(const ix_file**)a;
+    const ix_file* fb = *(const ix_file**)b;
+    int rc;
+
+    if((rc = strcmp(fa->subject, fb->subject)) != 0) {
+        return rc;
+    }
+    return strcmp(fa->poster, fb->poster);
+}
+
+/* The file table as an array sorted by subject */
+static ix_file** index_sorted(unsigned long* n) {
+    ix_file** files;
+    ix_file* f;
+    unsigned long i;
+
+    if((files = (ix_file**)calloc(ix.nfiles ? ix.nfiles : 1, sizeof(ix_file*))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    for(*n = 0, i = 0; i < ix.nbuckets; i++) {
+        for(f = ix.buckets[i]; f; f = f->hnext) {
+            files[(*n)++] = f;
+        }
+    }
+    qsort(files, *n, sizeof(ix_file*), compare_ix_files);
+    return files;
+}
+
+/* The parts of a file by part number, reposts after the first */
+static ix_part** index_parts(ix_file* f, ix_part** parts, unsigned int* maxparts) {
+    ix_part* pt;
+    unsigned int j;
+
+    if(f->nparts > *maxparts) {
+        free(parts);
+        *maxparts = f->nparts;
+        if((parts = (ix_part**)malloc(*maxparts * sizeof(ix_part*))) == NULL) {
+            perror("malloc");
+            *maxparts = 0;
+            return NULL;
+        }
+    }
+    for(j = 0, pt = f->parts; pt; pt = pt->next) {
+        parts[j++] = pt;
+    }
+    qsort(parts, j, sizeof(ix_part*), compare_parts);
+    return parts;
+}
+
+/* Write the file table as an NZB, files by subject and segments by part */
+int index_write_nzb(char* path, char* group) {
+    ix_file** files;
+    ix_part** parts = NULL;
+    unsigned int maxparts = 0;
+    unsigned long n;
+    unsigned long i;
+    unsigned int k;
+    FILE* fp;
+
+    if((files = index_sorted(&n)) == NULL) {
+        return NN_ERROR;
+    }
+    if((fp = fopen(path, "w")) == NULL) {
+        perror("fopen");
+        free(files);
+        return NN_ERROR;
+    }
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"iso-8859-1\" ?>\n"
+                "<!DOCTYPE nzb PUBLIC \"-//newzBin//DTD NZB 1.1//EN\" \"http://www.newzbin.com/DTD/nzb/nzb-1.1.dtd\">\n"
+                "<nzb xmlns=\"http://www.newzbin.com/DTD/2003/nzb\">\n");
+    for(i = 0; i < n; i++) {
+        if((parts = index_parts(files[i], parts, &maxparts)) == NULL) {
+            fclose(fp);
+            free(files);
+            return NN_ERROR;
+        }
+
+        fprintf(fp, "<file poster=\"");
+        xml_escape(fp, files[i]->poster);
+        fprintf(fp, "\" date=\"%lu\" subject=\"", (unsigned long)files[i]->date);
+        xml_escape(fp, files[i]->subject);
+        fprintf(fp, "\">\n<groups>\n<group>");
+        xml_escape(fp, group);
+        fprintf(fp, "</group>\n</groups>\n<segments>\n");
+        for(k = 0; k < files[i]->nparts; k++) {
+            if(k && parts[k]->number == parts[k - 1]->number) {
+                continue;   /* reposted part, keep the first */
+            }
+            fprintf(fp, "<segment bytes=\"%lu\" number=\"%u\">", parts[k]->bytes, parts[k]->number);
+            xml_escape(fp, parts[k]->msgid);
+            fprintf(fp, "</segment>\n");
+        }
+        fprintf(fp, "</segments>\n</file>\n");
+    }
+    fprintf(fp, "</nzb>\n");
+    fclose(fp);
+    free(parts);
+    free(files);
+    return NN_OK;
+}
+
+static void index_cleanup(void) {
+    ix_arena* a;
+
+    ix.headers = 0;
+    ix.parts = 0;
+    while((a = ix.arena) != NULL) {
+        ix.arena = a->next;
+        free(a);
+    }
+    free(ix.buckets); ix.buckets = NULL;
+    ix.nbuckets = 0;
+    ix.nfiles = 0;
+}
+
+/* Turn the file table into a file list for the download path, in the
+ * order index_write_nzb() would have written it, and empty the table */
+file_node* index_file_list(char* group) {
+    file_node* list = NULL;
+    file_node** tail = &list;
+    file_node* file;
+    segment_node** stail;
+    segment_node* segment;
+    ix_file** files;
+    ix_part** parts = NULL;
+    unsigned int maxparts = 0;
+    unsigned long n;
+    unsigned long i;
+    unsigned int k;
+
+    if((files = index_sorted(&n)) == NULL) {
+        index_cleanup();
+        return NULL;
+    }
+    for(i = 0; i < n; i++) {
+        if((parts = index_parts(files[i], parts, &maxparts)) == NULL) {
+            break;
+        }
+        if((file = (file_node*)calloc(1, sizeof(file_node))) == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        snprintf(file->poster, sizeof(file->poster), "%s", files[i]->poster);
+        snprintf(file->subject, sizeof(file->subject), "%s", files[i]->subject);
+        snprintf(file->group, sizeof(file->group), "%s", group);
+        file->date = files[i]->date;
+        file_set_filename(file);
+
+        stail = &file->segments;
+        for(k = 0; k < files[i]->nparts; k++) {
+            if(k && parts[k]->number == parts[k - 1]->number) {
+                continue;
+            }
+            if((segment = (segment_node*)calloc(1, sizeof(segment_node))) == NULL) {
+                perror("calloc");
+                exit(1);
+            }
+            segment->file = file;
+            segment->bytes = parts[k]->bytes;
+            segment->number = parts[k]->number;
+            snprintf(segment->msgid, sizeof(segment->msgid), "%s", parts[k]->msgid);
+            *stail = segment;
+            stail = &segment->next;
+        }
+        *tail = file;
+        tail = &file->next;
+    }
+    free(parts);
+    free(files);
+    index_cleanup();
+    return list;
+}
+
+/* Index 'group' over g.connections connections and write the NZB to
+ * 'path', or with -D append to the header database from where the last
+ * update stopped */
+int index_group(char* group, char* path, unsigned long first, unsigned long last) {
+    connection* conns;
+    unsigned long lo, hi;
+    int sock;
+    int i;
+    time_t start = time(NULL);
+
+    if((sock = server_connect(g.servers, 3)) == -1) {
+        fprintf(stderr, "%s: error connecting to server\n", __FUNCTION__);
+        return NN_ERROR;
+    }
+    if(index_range(&sock, group, &lo, &hi) < 0) {
+        server_disconnect(&sock);
+        return NN_ERROR;
+    }
+    server_disconnect(&sock);
+
+    if(g.header_db) {
+        if(hdrdb_open(g.header_db, group, 1) < 0) {
+            return NN_ERROR;
+        }
+        if(hdrdb_high_water() >= first) {
+            first = hdrdb_high_water() + 1;
+        }
+    }
+
+    ix.group = group;
+    ix.next = first > lo ? first : lo;
+    ix.last = last && last < hi ? last : hi;
+    ix.chunk = g.index_chunk ? g.index_chunk : INDEX_CHUNK;
+    ix.xzver = -1;
+    if(ix.next > ix.last) {
+        printf("%s: %s is up to date at article %lu\n", __FUNCTION__, group, ix.last);
+        return g.header_db ? hdrdb_close() : NN_OK;
+    }
+    printf("%s: indexing %s articles %lu-%lu\n", __FUNCTION__, group, ix.next, ix.last);
+
+    if((conns = (connection*)calloc(g.connections, sizeof(connection))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for(i = 0; i < g.connections; i++) {
+        conns[i].id = i;
+        conns[i].sock = -1;
+        conns[i].server = g.servers;
+        if(pthread_create(&conns[i].thread, NULL, index_thread, &conns[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for(i = 0; i < g.connections; i++) {
+        pthread_join(conns[i].thread, NULL);
+    }
+    free(conns);
+
+    if(g.header_db) {
+        printf("%s: %lu headers stored in %lu seconds\n", __FUNCTION__,
+            ix.headers, (unsigned long)(time(NULL) - start));
+    }
+    else {
+        printf("%s: %lu headers, %lu parts in %lu files in %lu seconds\n", __FUNCTION__,
+            ix.headers, ix.parts, ix.nfiles, (unsigned long)(time(NULL) - start));
+    }
+    if(ix.failed) {
+        fprintf(stderr, "%s: %lu chunks could not be fetched\n", __FUNCTION__, ix.failed);
+    }
+    if(g.header_db) {
+        /* a failed chunk is fetched again next time, along with the
+         * chunks after it; the duplicates merge as reposted parts */
+        if(ix.failed) {
+            hdrdb_set_high_water(ix.lowfail - 1);
+        }
+        else if(g.running) {
+            hdrdb_set_high_water(ix.last);
+        }
+        if(hdrdb_close() < 0) {
+            ix.failed++;
+        }
+    }
+    else if(g.running && index_write_nzb(path, group) == NN_OK) {
+        printf("%s: wrote %s\n", __FUNCTION__, path);
+    }
+    index_cleanup();
+    return ix.failed ? NN_ERROR : NN_OK;
+}
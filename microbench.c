@@ -0,0 +1,426 @@
+/* Microbenchmarks for the CPU-bound parts of nzbnews.
+ *
+ * Each kernel runs in a forked child so its peak RSS and allocation count
+ * are its own.  Inputs are synthetic: a generated NZB and yEnc articles
+ * built from random data.
+ *
+ *  usage: microbench [-j] [-i iterations] [-s article size] [-f nzb files]
+ *                    [-k kernel]
+ *
+ * -j prints one JSON object per kernel, for diffing results across commits.
+ */
+#include <libxml/parser.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nzbnews.h"
+
+/* allocation counting, wired up with -Wl,--wrap */
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void  __real_free(void* ptr);
+
+static unsigned long allocs = 0;
+
+void* __wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size) {
+    allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void* ptr) {
+    __real_free(ptr);
+}
+
+static char* bench_xml_strdup(const char* str) {
+    size_t len = strlen(str) + 1;
+    char* ret = __wrap_malloc(len);
+
+    if(ret) {
+        memcpy(ret, str, len);
+    }
+    return ret;
+}
+
+static struct _bench_t {
+    short json;
+    int iterations;
+    int article_size;
+    int nzb_files;
+    int nzb_segments;
+    char* kernel;
+    char tmpdir[256];
+} b;
+
+typedef struct _bench_result {
+    unsigned long long ns;
+    unsigned long long bytes;
+    unsigned long allocs;
+} bench_result;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Build a complete BODY response: status line, dot-stuffed yEnc lines and
+ * the terminator.  Returns the length. */
+static size_t gen_article(char* buf, size_t buflen, int size, unsigned int seed) {
+    unsigned char* data;
+    unsigned long crc;
+    size_t len = 0;
+    int col = 0;
+    int i;
+    unsigned char c;
+
+    if((data = malloc(size)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    srand(seed);
+    for(i = 0; i < size; i++) {
+        data[i] = rand() & 0xff;
+    }
+    crc = crc32_update(0, data, size);
+
+    len += snprintf(buf + len, buflen - len, "222 0 <bench.%u@nzbnews>\r\n", seed);
+    len += snprintf(buf + len, buflen - len,
+        "=ybegin part=1 total=1 line=128 size=%d name=bench.bin\r\n", size);
+    len += snprintf(buf + len, buflen - len, "=ypart begin=1 end=%d\r\n", size);
+    for(i = 0; i < size && len + 8 < buflen; i++) {
+        c = (unsigned char)(data[i] + 42);
+        if(col == 0 && c == '.') {
+            buf[len++] = '.';
+        }
+        if(c == 0 || c == '\n' || c == '\r' || c == '=') {
+            buf[len++] = '=';
+            c += 64;
+            col++;
+        }
+        buf[len++] = c;
+        if(++col >= 128) {
+            buf[len++] = '\r';
+            buf[len++] = '\n';
+            col = 0;
+        }
+    }
+    if(col) {
+        buf[len++] = '\r';
+        buf[len++] = '\n';
+    }
+    len += snprintf(buf + len, buflen - len,
+        "=yend size=%d part=1 pcrc32=%08lx\r\n.\r\n", size, crc);
+    free(data);
+    return len;
+}
+
+static void gen_nzb(char* path, int files, int segments) {
+    FILE* fp;
+    int i, j;
+
+    if((fp = fopen(path, "w")) == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"iso-8859-1\" ?>\n<nzb>\n");
+    for(i = 0; i < files; i++) {
+        fprintf(fp, " <file poster=\"bench@nzbnews\" date=\"1700000000\" "
+                    "subject=\"&quot;bench.part%03d.rar&quot; yEnc (1/%d)\">\n", i, segments);
+        fprintf(fp, "  <groups><group>alt.binaries.test</group></groups>\n  <segments>\n");
+        for(j = 0; j < segments; j++) {
+            fprintf(fp, "   <segment bytes=\"%d\" number=\"%d\">part%d.%d.%08x@nzbnews</segment>\n",
+                b.article_size, j + 1, i, j, rand());
+        }
+        fprintf(fp, "  </segments>\n </file>\n");
+    }
+    fprintf(fp, "</nzb>\n");
+    fclose(fp);
+}
+
+static void bench_parse_nzb(bench_result* r) {
+    char path[512];
+    struct stat finfo;
+    file_node* list;
+    unsigned long long start;
+    int i;
+
+    snprintf(path, sizeof(path), "%s/bench.nzb", b.tmpdir);
+    gen_nzb(path, b.nzb_files, b.nzb_segments);
+    stat(path, &finfo);
+
+    for(i = 0; i < b.iterations; i++) {
+        start = now_ns();
+        list = parse_nzb(path);
+        r->ns += now_ns() - start;
+        r->bytes += finfo.st_size;
+        del_file_list(list);
+    }
+    unlink(path);
+}
+
+/* Feed the article in recv-sized chunks, the way get_segment() sees it */
+static void bench_terminator(bench_result* r) {
+    size_t buflen = b.article_size * 2 + 4096;
+    char* buf = malloc(buflen);
+    size_t len = gen_article(buf, buflen, b.article_size, 1);
+    size_t off;
+    size_t chunk = 16384;
+    unsigned long long start;
+    int found = 0;
+    int i;
+
+    for(i = 0; i < b.iterations; i++) {
+        start = now_ns();
+        for(off = 0; off < len; off += chunk) {
+            if(find_terminator(buf, off + chunk < len ? off + chunk : len, off)) {
+                found++;
+            }
+        }
+        r->ns += now_ns() - start;
+        r->bytes += len;
+    }
+    if(found != b.iterations) {
+        fprintf(stderr, "%s: terminator found %d times in %d runs\n", __FUNCTION__, found, b.iterations);
+    }
+    free(buf);
+}
+
+static void bench_remove_dots(bench_result* r) {
+    size_t buflen = b.article_size * 2 + 4096;
+    char* src = malloc(buflen);
+    char* dst = malloc(buflen);
+    size_t len = gen_article(src, buflen, b.article_size, 2);
+    unsigned long long start;
+    int i;
+
+    for(i = 0; i < b.iterations; i++) {
+        start = now_ns();
+        remove_dots(src, len, dst, buflen);
+        r->ns += now_ns() - start;
+        r->bytes += len;
+    }
+    free(src);
+    free(dst);
+}
+
+static void bench_yenc_decode(bench_result* r) {
+    size_t buflen = b.article_size * 2 + 4096;
+    char* src = malloc(buflen);
+    unsigned char* dst = malloc(buflen);
+    size_t len = gen_article(src, buflen, b.article_size, 3);
+    unsigned long long start;
+    yenc_info info;
+    int i;
+
+    len = remove_dots(src, len, src, buflen);
+    for(i = 0; i < b.iterations; i++) {
+        start = now_ns();
+        yenc_decode(src, len, dst, buflen, &info);
+        r->ns += now_ns() - start;
+        r->bytes += len;
+    }
+    if(info.pcrc32 != info.crc32) {
+        fprintf(stderr, "%s: crc mismatch\n", __FUNCTION__);
+    }
+    free(src);
+    free(dst);
+}
+
+/* The whole decode_file() step: uudeview over segment files on disk */
+static void bench_decode_file(bench_result* r) {
+    size_t buflen = b.article_size * 2 + 4096;
+    char* buf = malloc(buflen);
+    char path[1024];
+    file_node file;
+    segment_node segment;
+    unsigned long long start;
+    FILE* fp;
+    size_t len;
+    int i;
+
+    memset(&file, 0, sizeof(file));
+    memset(&segment, 0, sizeof(segment));
+    strcpy(file.filename, "bench");
+    segment.number = 1;
+    segment.file = &file;
+    file.segments = &segment;
+
+    len = gen_article(buf, buflen, b.article_size, 4);
+    len = remove_dots(buf, len, buf, buflen);
+    g.outdir = b.tmpdir;
+
+    for(i = 0; i < b.iterations; i++) {
+        snprintf(path, sizeof(path), "%s/.%s.%u", g.outdir, file.filename, segment.number);
+        if((fp = fopen(path, "w")) == NULL) {
+            perror("fopen");
+            break;
+        }
+        fwrite(buf, 1, len, fp);
+        fclose(fp);
+
+        start = now_ns();
+        decode_file(&file);
+        r->ns += now_ns() - start;
+        r->bytes += len;
+
+        snprintf(path, sizeof(path), "%s/bench.bin", g.outdir);
+        unlink(path);
+    }
+    free(buf);
+}
+
+static void bench_response_status(bench_result* r) {
+    static char* responses[] = {
+        "222 0 <part1of10.abc@nzbnews> body follows\r\n",
+        "430 no such article\r\n",
+        "211 1234 1000 2233 alt.binaries.test\r\n",
+        "223 0 <part2of10.abc@nzbnews>\r\n",
+    };
+    unsigned long long start;
+    size_t len = 0;
+    int sum = 0;
+    int i, j;
+
+    for(j = 0; j < 4; j++) {
+        len += strlen(responses[j]);
+    }
+    for(i = 0; i < b.iterations * 1000; i++) {
+        start = now_ns();
+        for(j = 0; j < 4; j++) {
+            sum += check_response_status(responses[j]);
+        }
+        r->ns += now_ns() - start;
+        r->bytes += len;
+    }
+    if(sum == 0) {
+        fprintf(stderr, "%s: no status parsed\n", __FUNCTION__);
+    }
+}
+
+static struct {
+    char* name;
+    void (*fn)(bench_result*);
+} kernels[] = {
+    { "parse_nzb",          bench_parse_nzb },
+    { "find_terminator",    bench_terminator },
+    { "remove_dots",        bench_remove_dots },
+    { "yenc_decode",        bench_yenc_decode },
+    { "decode_file",        bench_decode_file },
+    { "response_status",    bench_response_status },
+    { NULL, NULL }
+};
+
+static void report(char* name, bench_result* r, long peak_rss) {
+    double ns_per_byte = r->bytes ? (double)r->ns / r->bytes : 0;
+    double mb_s = r->ns ? (r->bytes / (1024.0 * 1024.0)) / (r->ns / 1e9) : 0;
+
+    if(b.json) {
+        printf("{\"kernel\":\"%s\",\"iterations\":%d,\"bytes\":%llu,\"ns\":%llu,"
+               "\"ns_per_byte\":%.4f,\"mb_s\":%.2f,\"allocs\":%lu,\"peak_rss_kb\":%ld}\n",
+            name, b.iterations, r->bytes, r->ns, ns_per_byte, mb_s, r->allocs, peak_rss);
+    }
+    else {
+        printf("%-18s %12llu %10.4f %10.2f %10lu %10ld\n",
+            name, r->bytes, ns_per_byte, mb_s, r->allocs, peak_rss);
+    }
+    fflush(stdout);
+}
+
+static void run_kernel(int k) {
+    bench_result r;
+    struct rusage usage;
+    pid_t pid;
+    int status;
+
+    if((pid = fork()) == -1) {
+        perror("fork");
+        exit(1);
+    }
+    else if(pid == 0) {
+        memset(&r, 0, sizeof(r));
+        allocs = 0;
+        kernels[k].fn(&r);
+        r.allocs = allocs;
+        getrusage(RUSAGE_SELF, &usage);
+        report(kernels[k].name, &r, usage.ru_maxrss);
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    if(!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "%s: kernel %s failed\n", __FUNCTION__, kernels[k].name);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    int k;
+
+    b.iterations = 100;
+    b.article_size = 768000;
+    b.nzb_files = 100;
+    b.nzb_segments = 100;
+
+    while((opt = getopt(argc, argv, "hji:s:f:k:")) != EOF) {
+        switch(opt) {
+        case 'j':
+            b.json = 1;
+            break;
+        case 'i':
+            b.iterations = atoi(optarg);
+            break;
+        case 's':
+            b.article_size = atoi(optarg);
+            break;
+        case 'f':
+            b.nzb_files = atoi(optarg);
+            break;
+        case 'k':
+            b.kernel = optarg;
+            break;
+        case 'h':
+        default:
+            printf("usage: microbench [-j] [-i iterations] [-s article size] [-f nzb files] [-k kernel]\n");
+            exit(0);
+        }
+    }
+
+    xmlMemSetup(__wrap_free, __wrap_malloc, __wrap_realloc, bench_xml_strdup);
+
+    snprintf(b.tmpdir, sizeof(b.tmpdir), "/tmp/microbench.XXXXXX");
+    if(mkdtemp(b.tmpdir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    g.running = 1;
+
+    if(!b.json) {
+        printf("%-18s %12s %10s %10s %10s %10s\n",
+            "kernel", "bytes", "ns/byte", "MB/s", "allocs", "peak kB");
+        fflush(stdout);
+    }
+    for(k = 0; kernels[k].name; k++) {
+        if(!b.kernel || !strcmp(b.kernel, kernels[k].name)) {
+            run_kernel(k);
+        }
+    }
+    rmdir(b.tmpdir);
+    return 0;
+}
@@ -20,6 +20,7 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -29,35 +30,16 @@
 
 #include "nzbnews.h"
 
-#define NN_OK           0
-#define NN_ERROR        -1
-#define NN_TIMEOUT      -2
-#define NN_UNKNOWN      -3
-
-#define DEBUG   if(g.debug >= 1) printf
-#define DEBUG2  if(g.debug >= 2) printf
-#define DEBUG3  if(g.debug >= 3) printf
-#define DEBUG4  if(g.debug >= 4) printf
-
-static struct _global_t {
-    short running;
-    short debug;
-    short verify;
-    short anonymous;
-    char *config;
-    char *server;
-    char *username;
-    char *password;
-    char *nzbfile;
-    char *outdir;
-    struct {
-        time_t start;
-        time_t last;
-        unsigned long bytes;
-        unsigned long last_bytes;
-        float rate;
-    } stats;
-} g;
+#define HEDGE_DRAIN_MAX     (256 * 1024)    /* drain a lost hedge rather than reconnect */
+#define CONNECT_FAILURES    10              /* in a row before a connection gives up under -A */
+
+global_t g;
+
+/* the connection owned by the calling thread, NULL outside connection threads */
+static __thread connection* current = NULL;
+
+/* uudeview keeps its state in globals, so only one decode may run at a time */
+static pthread_mutex_t decode_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int file_exists(char* filename) {
     struct stat finfo;
@@ -86,14 +68,23 @@ int check_response_status(char* response) {
     if((rc = sscanf(response, "%d %*s", &ret)) != 1) {
         ret = NN_ERROR;
     }
+    PROBE2(response, ret, response);
     return ret;
 }
 
+/* send_msg() and recv_msg() wait for the socket as long as rtt.c finds
+ * reasonable for the connection; a timeout in seconds other than 0 fixes
+ * the wait instead. */
 int send_msg(int sock, char* buf, int len, int timeout) {
     int rc;
     fd_set fds;
     struct timeval tv;
+    long ms;
 
+    PROBE3(cmd_send, sock, buf, len);
+    if(g.replay) {
+        return session_send(sock, buf, len);
+    }
     if((rc = send(sock, buf, len, 0)) == -1) {
         if(errno != EAGAIN) {
             perror("send");
@@ -101,73 +92,91 @@ int send_msg(int sock, char* buf, int len, int timeout) {
         }
     }
     else {
+        if(g.record) {
+            session_log(sock, SESSION_SEND, buf, rc);
+        }
+        rtt_sent(sock);
         return rc;
     }
     
     FD_ZERO(&fds);
     FD_SET(sock, &fds);
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
+    ms = rtt_timeout(sock, timeout);
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
 
     if((rc = select(sock + 1, NULL, &fds, NULL, &tv)) == -1) {
         perror("select");
         return NN_ERROR;
     }
     else if(rc == 0) {
-        fprintf(stderr, "%s: timed out sending data\n", __FUNCTION__);
+        fprintf(stderr, "%s: timed out sending data after %ld ms\n", __FUNCTION__, ms);
         return NN_TIMEOUT;
     }
     else {
-        return send(sock, buf, len, 0);
+        if((rc = send(sock, buf, len, 0)) > 0) {
+            if(g.record) {
+                session_log(sock, SESSION_SEND, buf, rc);
+            }
+            rtt_sent(sock);
+        }
+        return rc;
     }
     return NN_ERROR;
 }
 
+/* Count, and with -W record, the outcome of a receive */
+static int received(int sock, char* buf, int rc) {
+    rtt_received(sock, rc);
+    if(rc > 0) {
+        __sync_fetch_and_add(&g.stats.bytes, rc);
+        if(current) {
+            __sync_fetch_and_add(&current->server->bytes, rc);
+            __sync_fetch_and_add(&current->bytes, rc);
+        }
+    }
+    if(g.record) {
+        session_log(sock, rc >= 0 ? SESSION_RECV : rc == NN_TIMEOUT ? SESSION_TIMEOUT : SESSION_ERROR,
+            buf, rc);
+    }
+    return rc;
+}
+
 int recv_msg(int sock, char* buf, int len, int timeout) {
     int rc;
     fd_set fds;
     struct timeval tv;
+    long ms;
 
+    if(g.replay) {
+        return received(sock, buf, session_recv(sock, buf, len));
+    }
     if((rc = recv(sock, buf, len, 0)) == -1) {
         if(errno != EAGAIN) {
             perror("recv");
-            return NN_ERROR;
+            return received(sock, buf, NN_ERROR);
         }
     }
     else {
-        g.stats.bytes += rc;
-        if((time(NULL) - g.stats.last) >= 1) {
-            g.stats.rate = ((g.stats.bytes - g.stats.last_bytes) * (1.0))/ 
-                           ((time(NULL) - g.stats.last) * 1.0);
-            g.stats.last = time(NULL);
-            g.stats.last_bytes = g.stats.bytes;
-        }
-        return rc;
+        return received(sock, buf, rc);
     }
    
     FD_ZERO(&fds);
     FD_SET(sock, &fds);
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
+    ms = rtt_timeout(sock, timeout);
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
 
     if((rc = select(sock + 1, &fds, NULL, NULL, &tv)) == -1) {
         perror("select");
-        return NN_ERROR;
+        return received(sock, buf, NN_ERROR);
     }
     else if(rc == 0) {
-        fprintf(stderr, "%s: timed out receiving data\n", __FUNCTION__);
-        return NN_TIMEOUT;
+        fprintf(stderr, "%s: timed out receiving data after %ld ms\n", __FUNCTION__, ms);
+        return received(sock, buf, NN_TIMEOUT);
     }
     else {
-        rc = recv(sock, buf, len, 0);
-        g.stats.bytes += rc;
-        if((time(NULL) - g.stats.last) >= 1) {
-            g.stats.rate = ((g.stats.bytes - g.stats.last_bytes) * (1.0))/ 
-                           ((time(NULL) - g.stats.last) * 1.0);
-            g.stats.last = time(NULL);
-            g.stats.last_bytes = g.stats.bytes;
-        }
-        return rc;
+        return received(sock, buf, recv(sock, buf, len, 0));
     }
     return -1;
 }
@@ -193,6 +202,26 @@ char* remove_dangerous_shell_chars(char* buf, size_t len) {
     return ret;
 }
 
+/* Name the segment files of a file after the md5 of its subject */
+void file_set_filename(file_node* file) {
+    char cmd[512];
+    FILE* fp = NULL;
+    char* p;
+
+    snprintf(cmd, sizeof(cmd), "echo \"%s\" | md5sum | awk '{print $1}'",
+        remove_dangerous_shell_chars(file->subject, strlen(file->subject)));
+    if((fp = popen(cmd, "r")) == NULL) {
+        perror("popen");
+        exit(1);
+    }
+    fgets(file->filename, sizeof(file->filename), fp);
+    pclose(fp);
+
+    if((p = strchr(file->filename, '\n')) != NULL) {
+        *p = '\0';
+    }
+}
+
 /* Parses a .nzb file and returns a linked-list of files, along with their
  * list of segments */
 file_node* parse_nzb(char* nzbfile) {
@@ -210,15 +239,11 @@ file_node* parse_nzb(char* nzbfile) {
     xmlChar*    bytes = NULL;
     xmlChar*    number = NULL;
     xmlChar*    msgid = NULL;
-    char        cmd[512];
-    FILE*       fp = NULL;
-    char*       p;
-
     file_node*      file_list = NULL;
     file_node*      fptr = NULL;
     segment_node*   sptr = NULL;
-    file_node*      fwalk = NULL;
-    segment_node*   swalk = NULL;
+    file_node*      ftail = NULL;
+    segment_node*   stail = NULL;
 
     if((doc = xmlParseFile(nzbfile)) != NULL) {
         if((nzb = xmlDocGetRootElement(doc)) != NULL) {
@@ -236,29 +261,15 @@ file_node* parse_nzb(char* nzbfile) {
                         strncpy(fptr->poster, poster, sizeof(fptr->poster));
                         strncpy(fptr->subject, subject, sizeof(fptr->subject));
                         fptr->date = strtoul(date, NULL, 10);
-                        snprintf(cmd, sizeof(cmd), "echo \"%s\" | md5sum | awk '{print $1}'",
-                            remove_dangerous_shell_chars(fptr->subject, strlen(fptr->subject)));
-                        if((fp = popen(cmd, "r")) == NULL) {
-                            perror("popen");
-                            exit(1);
-                        }
-                        fgets(fptr->filename, sizeof(fptr->filename), fp);
-                        pclose(fp);
-            
-                        if((p = strchr(fptr->filename, '\n')) != NULL) {
-                            *p = '\0';
-                        }
+                        file_set_filename(fptr);
                         
                         if(!file_list) {
                             file_list = fptr;
                         }
                         else {
-                            fwalk = file_list;
-                            while(fwalk->next) {
-                                fwalk = fwalk->next;
-                            }
-                            fwalk->next = fptr;
+                            ftail->next = fptr;
                         }
+                        ftail = fptr;
             
                         xmlFree(poster);
                         xmlFree(date);
@@ -288,6 +299,7 @@ file_node* parse_nzb(char* nzbfile) {
                                             perror("calloc");
                                             exit(1);
                                         }
+                                        sptr->file = fptr;
                                         sptr->bytes = strtoul(bytes, NULL, 10);
                                         sptr->number = strtoul(number, NULL, 10);
                                         strncpy(sptr->msgid, msgid, sizeof(sptr->msgid));
@@ -296,12 +308,9 @@ file_node* parse_nzb(char* nzbfile) {
                                             fptr->segments = sptr;
                                         }
                                         else {
-                                            swalk = fptr->segments;
-                                            while(swalk->next) {
-                                                swalk = swalk->next;
-                                            }
-                                            swalk->next = sptr;
+                                            stail->next = sptr;
                                         }
+                                        stail = sptr;
 
                                         xmlFree(bytes);
                                         xmlFree(number);
@@ -328,9 +337,15 @@ file_node* parse_nzb(char* nzbfile) {
     return file_list;
 }
 
-/* Get a list of files/segments for download */
+/* Get a list of files/segments for download, from the NZB's image if
+ * there is one */
 file_node* get_file_list(char* file) {
-    return parse_nzb(file);
+    file_node* list;
+
+    if((list = image_load(file)) == NULL && (list = parse_nzb(file)) != NULL) {
+        image_write(file, list);
+    }
+    return list;
 }
 
 /* Delete the list of files/segments when you're done */
@@ -343,11 +358,15 @@ int del_file_list(file_node* list) {
         while(list->segments) {
             segment = list->segments;
             list->segments = list->segments->next;
-            free(segment);
+            if(!image_owns(segment)) {
+                free(segment);
+            }
             segment = NULL;
         }
         list = list->next;
-        free(walk);
+        if(!image_owns(walk)) {
+            free(walk);
+        }
         walk = NULL;
     }
     return 0;
@@ -392,7 +411,11 @@ int decode_file(file_node *file)
     segment_node *segment = NULL;
     uulist *item = NULL;
     int i;
+    unsigned long long tspan;
 
+    pthread_mutex_lock(&decode_lock);
+    tspan = trace_begin();
+    PROBE2(decode_start, file->filename, file->index);
     UUInitialize();
     UUSetBusyCallback(NULL, uu_busy_callback);
     UUSetMsgCallback(NULL, uu_msg_callback);
@@ -407,10 +430,19 @@ int decode_file(file_node *file)
     }
 
     for(i = 0; (item = UUGetFileListItem(i)) != NULL; i++) {
+        /* the probe reserved the space for it: fill that in */
+        if(file->size && item->filename && !strcmp(item->filename, file->name)
+        && UUDecodeToTemp(item) == UURET_OK && item->binfile
+        && probe_fill(item->binfile, uu_fname_filter(NULL, item->filename)) == NN_OK) {
+            continue;
+        }
         UUDecodeFile(item, NULL);
     }
 
+    PROBE2(decode_end, file->filename, i);
     UUCleanUp();
+    trace_end("decode_file", tspan, file->index);
+    pthread_mutex_unlock(&decode_lock);
     
     for(segment = file->segments; segment; segment = segment->next) {
         char segment_name[1024];
@@ -489,20 +521,44 @@ int server_set_mode_reader(int sock) {
     return NN_ERROR;
 }
 
-int server_connect(int retries) {
+/* Add a server given as host[:port] to the end of the server list */
+server_node* server_add(char* host) {
+    server_node* server;
+    server_node* walk;
+    char* p;
+
+    if((server = (server_node*)calloc(1, sizeof(server_node))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    server->host = strdup(host);
+    server->port = 119;
+    if((p = strrchr(server->host, ':')) != NULL) {
+        *p = '\0';
+        server->port = atoi(p + 1);
+    }
+    server->max = 1;
+
+    if(!g.servers) {
+        g.servers = server;
+    }
+    else {
+        for(walk = g.servers; walk->next; walk = walk->next);
+        walk->next = server;
+        server->id = walk->id + 1;
+    }
+    return server;
+}
+
+/* Open a non-blocking TCP connection to the server */
+static int server_open(server_node* server) {
     int sock;
     struct sockaddr_in addr;
-    char buf[1024];
     struct hostent* hostinfo = NULL;
     int flags;
-    int rc;
-    
-    if((hostinfo = gethostbyname(g.server)) == NULL) {
-        perror("gethostbyname");
-        return NN_ERROR;
-    }
 
-    if(!retries--) {    /* we recursed until we ran out of retries */
+    if((hostinfo = gethostbyname(server->host)) == NULL) {
+        perror("gethostbyname");
         return NN_ERROR;
     }
 
@@ -511,7 +567,7 @@ int server_connect(int retries) {
         return NN_ERROR;
     }
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(119);
+    addr.sin_port = htons(server->port);
     memcpy(&addr.sin_addr.s_addr, hostinfo->h_addr, hostinfo->h_length);
     memset(&addr.sin_zero, 0x0, sizeof(addr.sin_zero));
     if(connect(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr)) == -1) {
@@ -523,9 +579,28 @@ int server_connect(int retries) {
     flags = fcntl(sock, F_GETFL);
     flags |= O_NONBLOCK;
     fcntl(sock, F_SETFL, flags);
-    
+    rtt_open(sock);
+
+    if(g.record) {
+        session_log(sock, SESSION_CONNECT, server->host, strlen(server->host));
+    }
+    return sock;
+}
+
+int server_connect(server_node* server, int retries) {
+    int sock;
+    char buf[1024];
+    int rc;
+
+    if(!retries--) {    /* we recursed until we ran out of retries */
+        return NN_ERROR;
+    }
+    if((sock = g.replay ? session_connect() : server_open(server)) < 0) {
+        return NN_ERROR;
+    }
+
     if(recv_msg(sock, buf, sizeof(buf), 0) < 0) {
-        fprintf(stderr, "%s: error receiving greeting from server %s\n", __FUNCTION__, g.server);
+        fprintf(stderr, "%s: error receiving greeting from server %s\n", __FUNCTION__, server->host);
         server_disconnect(&sock);
         return NN_ERROR;
     }
@@ -533,10 +608,18 @@ int server_connect(int retries) {
     if(rc == NNTP_READY || rc == NNTP_READY_NO_POSTING) {
         printf("%s: connected to news server\n", __FUNCTION__);
     }
+    else if(rc == NNTP_DISCONTINUED && g.auto_connections) {
+        /* let the connection controller back off instead of sleeping */
+        fprintf(stderr, "%s: too many connections to %s\n", __FUNCTION__, server->host);
+        connctl_error(server);
+        close(sock);
+        return NN_ERROR;
+    }
     else if(rc == NNTP_DISCONTINUED) {   /* too many connections */
         fprintf(stderr, "%s: too many connections...sleeping\n", __FUNCTION__);
+        close(sock);
         sleep(10);
-        return server_connect(retries);
+        return server_connect(server, retries);
     }
     else {
         fprintf(stderr, "%s: unexpected greeting from server [%s]\n", __FUNCTION__, buf);
@@ -544,7 +627,7 @@ int server_connect(int retries) {
         return NN_ERROR;
     }
     if(!g.anonymous) {
-        if(server_login(sock, g.username, g.password) < 0) {
+        if(server_login(sock, server->username, server->password) < 0) {
             fprintf(stderr, "%s: login failed\n", __FUNCTION__);
             return NN_ERROR;
         }
@@ -553,12 +636,14 @@ int server_connect(int retries) {
         fprintf(stderr, "%s: failed to set reader mode\n", __FUNCTION__);
         return NN_ERROR;
     }
+    PROBE2(conn_open, sock, server->host);
     return sock;
 }
 
 int server_disconnect(int* sock) {
     char buf[1024];
     
+    PROBE1(conn_close, *sock);
     snprintf(buf, sizeof(buf), "EXIT\r\n");
     if(send_msg(*sock, buf, strlen(buf), 0) < 0) {
         fprintf(stderr, "%s: error logging out\n", __FUNCTION__);
@@ -571,70 +656,179 @@ int server_disconnect(int* sock) {
 }
 
 int connection_reset(int* sock) {
+    unsigned long long tspan;
+
+    PROBE1(conn_reset, *sock);
     server_disconnect(sock);
-    *sock = server_connect(3);
+    tspan = trace_begin();
+    *sock = server_connect(current ? current->server : g.servers, 3);
+    trace_end("server_connect", tspan, -1);
     return *sock;
 }
 
+/* Look for the "\r\n.\r\n" that ends a multi-line response.  Only the bytes
+ * from 'from' onwards are new, but the terminator may straddle the previous
+ * read, so back up a little. */
+char* find_terminator(char* buf, size_t len, size_t from) {
+    char* p = buf + (from > 4 ? from - 4 : 0);
+    char* end = buf + len;
+
+    while(p < end && (p = memchr(p, '.', end - p)) != NULL) {
+        if(p - buf >= 2 && end - p >= 3
+        && p[-2] == '\r' && p[-1] == '\n' && p[1] == '\r' && p[2] == '\n') {
+            return p - 2;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/* Undo NNTP dot-stuffing.  Copies src to dst dropping the leading '.' of
+ * each line and stops at the terminating "." line.  dst may equal src.
+ * Returns the number of bytes written. */
+int remove_dots(char* src, size_t srclen, char* dst, int dstlen) {
+    char* p = src;
+    char* end = src + srclen;
+    char* eol;
+    size_t len;
+    int out = 0;
+
+    while(p < end) {
+        if((eol = memchr(p, '\n', end - p)) == NULL) {
+            eol = end;
+        }
+        else {
+            eol++;
+        }
+        if(p[0] == '.') {
+            if(eol - p <= 3 && (p[1] == '\r' || p[1] == '\n')) {
+                break;
+            }
+            p++;
+        }
+        len = eol - p;
+        if(out + len > dstlen) {
+            len = dstlen - out;
+        }
+        memmove(dst + out, p, len);
+        out += len;
+        p = eol;
+    }
+    return out;
+}
+
 int get_segment(int* sock, file_node* file, segment_node* segment) {
     char *buf = NULL;
     char *pbuf = NULL;
+    char *bigger = NULL;
     size_t buflen;
     size_t bufleft;
-    int ret;
+    int ret = NN_ERROR;
     short done;
+    short complete = 0;
     short retries;
     int bytes;
     char filename[256];
+    char tmpname[300];
+    short lost = 0;
     FILE* fp = NULL;
     int rc;
+    unsigned long long tseg;
+    unsigned long long tspan;
 
-    buflen = segment->bytes * 2;
-    bufleft = buflen;
-    buf = calloc(1, buflen);
-    if(!buf) {
-        perror("calloc");
-        return NN_ERROR;
-    }
-    pbuf = buf;
+    tseg = trace_begin();
 
-    printf("%s: msgid=%s\n", __FUNCTION__, segment->msgid);
+    DEBUG("%s: msgid=%s\n", __FUNCTION__, segment->msgid);
 
     snprintf(filename, sizeof(filename), "%s/.%s.%u", g.outdir, file->filename, segment->number);
 
+    /* each attempt writes its own copy; the first to finish renames it
+     * into place */
+    snprintf(tmpname, sizeof(tmpname), "%s.%lx", filename, (unsigned long)pthread_self());
+
     if(file_exists(filename)) {
-        printf("%s: file already exists\n", __FUNCTION__);
-        return 0;
+        DEBUG("%s: file already exists\n", __FUNCTION__);
+        return sched_claim(segment) ? 1 : NN_LOST;
+    }
+    if(g.cache && cache_fetch(segment->msgid, tmpname) == NN_OK) {
+        DEBUG("%s: found in cache\n", __FUNCTION__);
+        trace_end("get_segment", tseg, segment->number);
+        if(!sched_claim(segment)) {
+            unlink(tmpname);
+            return NN_LOST;
+        }
+        rename(tmpname, filename);
+        return 1;
+    }
+
+    /* bytes= comes from the NZB, so it is only a hint; the pool clamps it
+     * and the buffer is grown below if the article turns out larger */
+    if((buf = pool_get((size_t)segment->bytes * 2, &buflen)) == NULL) {
+        return NN_ERROR;
     }
-    if((fp = fopen(filename, "w")) == NULL) {
+    bufleft = buflen;
+    pbuf = buf;
+
+    if((fp = fopen(tmpname, "w")) == NULL) {
         perror("fopen");
+        pool_put(buf);
         return NN_ERROR;
     }
     
     snprintf(buf, buflen, "BODY <%s>\r\n", segment->msgid);
+    PROBE3(body_start, *sock, segment->msgid, segment->bytes);
+    tspan = trace_begin();
     if(send_msg(*sock, buf, strlen(buf), 0) < 0) {
-        fprintf(stderr, "%s: error sending BODY command\n", __FUNCTION__);
+        progress_message(stderr, "%s: error sending BODY command\n", __FUNCTION__);
         ret = NN_ERROR;
     }
     else {
-        if((bytes = recv_msg(*sock, pbuf, bufleft, 0)) > 0) {
+        trace_end("body_send", tspan, segment->number);
+        tspan = trace_begin();
+        /* the server may take a while to find the article: each wait for
+         * the first byte is twice as patient as the last (see rtt.c) */
+        retries = 0;
+        while((bytes = recv_msg(*sock, pbuf, bufleft - 1, 0)) == NN_TIMEOUT && ++retries < 3 && g.running) {
+            progress_message(stderr, "%s: timed out waiting for BODY response.  Retrying...[%d]\n",
+                __FUNCTION__, retries);
+        }
+        if(bytes > 0) {
             buf[bytes] = '\0';
+            trace_end("body_first_byte", tspan, segment->number);
+            tspan = trace_begin();
             if((rc = check_response_status(pbuf)) == NNTP_BODY_OK) {
                 ret = 0;
-                done = 0;
+                done = complete = find_terminator(buf, bytes, 0) != NULL;
                 retries = 0;
                 bufleft -= bytes;
                 pbuf += bytes;
 
                 while(!done && g.running) {
-                    if((bytes = recv_msg(*sock, pbuf, bufleft, 0)) > 0) {
+                    if(bufleft < 2) {
+                        if((bigger = pool_grow(buf, buflen - bufleft, &buflen)) == NULL) {
+                            progress_message(stderr, "%s: article too large\n", __FUNCTION__);
+                            ret = NN_ERROR;
+                            break;
+                        }
+                        bufleft = buflen - (pbuf - buf);
+                        pbuf = bigger + (pbuf - buf);
+                        buf = bigger;
+                    }
+                    if(!lost && __atomic_load_n(&segment->won, __ATOMIC_RELAXED)) {
+                        /* another attempt finished first: drain the rest if
+                         * it is short, otherwise drop the connection */
+                        lost = 1;
+                        if(segment->bytes > pbuf - buf + HEDGE_DRAIN_MAX) {
+                            DEBUG("%s: hedged segment lost, resetting connection\n", __FUNCTION__);
+                            connection_reset(sock);
+                            break;
+                        }
+                    }
+                    if((bytes = recv_msg(*sock, pbuf, bufleft - 1, 0)) > 0) {
                         pbuf[bytes] = '\0';
-                        printf("%s: %8.2f kB/s %3.0f%%\r", 
-                            __FUNCTION__,
-                            g.stats.rate/1000,
-                            ceilf(((buflen - bufleft) * 100.0)/segment->bytes));
-                        if(strstr(pbuf, "\r\n.\r\n")) {
+                        if(find_terminator(buf, pbuf - buf + bytes, pbuf - buf)) {
                             done = 1;
+                            complete = 1;
                         }
                         bufleft -= bytes;
                         pbuf += bytes;
@@ -642,64 +836,80 @@ int get_segment(int* sock, file_node* file, segment_node* segment) {
                     }
                     else if(bytes == NN_TIMEOUT) {
                         if(++retries >= 3) {
-                            fprintf(stderr, "%s: retries exhausted waiting for BODY text\n", __FUNCTION__);
+                            progress_message(stderr, "%s: retries exhausted waiting for BODY text\n", __FUNCTION__);
                             done = 1;
                         }
                         else {
-                            fprintf(stderr, "%s: timed out waiting for BODY text.  Retrying...[%d]\n", __FUNCTION__, retries);
+                            progress_message(stderr, "%s: timed out waiting for BODY text.  Retrying...[%d]\n",
+                                __FUNCTION__, retries);
                         }
                     }
                     else if(bytes == -1) {
-                        fprintf(stderr, "%s: error receiving BODY text\n", __FUNCTION__);
+                        progress_message(stderr, "%s: error receiving BODY text\n", __FUNCTION__);
                         done = 1;
                         ret = NN_ERROR;
                     }
                     else if(bytes == 0) {
-                        fprintf(stderr, "%s: remote connection closed while receiving BODY text\n", __FUNCTION__);
+                        progress_message(stderr, "%s: remote connection closed while receiving BODY text\n", __FUNCTION__);
                         done = 1;
                         ret = NN_ERROR;
                     }
                 }
+                trace_end("body_recv", tspan, segment->number);
             }
             else if(rc == NNTP_NO_SUCH_ARTICLE) {
-                printf("%s: no such article\n", __FUNCTION__);
-                ret = NN_ERROR;
+                DEBUG("%s: no such article\n", __FUNCTION__);
+                ret = NN_MISSING;
             }
             else {
-                printf("%s: unexpected response to BODY command [%.40s]\n", __FUNCTION__, buf);
+                progress_message(stdout, "%s: unexpected response to BODY command [%.40s]\n", __FUNCTION__, buf);
                 ret = NN_ERROR;
             }
         }
         else if(bytes == NN_TIMEOUT) {
-            fprintf(stderr, "%s: timed out waiting for BODY response\n", __FUNCTION__);
-            ret = NN_ERROR;
+            progress_message(stderr, "%s: timed out waiting for BODY response\n", __FUNCTION__);
+            ret = NN_TIMEOUT;
         }
         else if(bytes == -1) {
-            fprintf(stderr, "%s: error receiving BODY response\n", __FUNCTION__);
+            progress_message(stderr, "%s: error receiving BODY response\n", __FUNCTION__);
             ret = NN_ERROR;
         }
         else if(bytes == 0) {
-            fprintf(stderr, "%s: remote connection closed\n", __FUNCTION__);
+            progress_message(stderr, "%s: remote connection closed\n", __FUNCTION__);
             ret = NN_ERROR;
         }
-        printf("\n");
     
-        pbuf = strtok(buf, "\n");
-        while(pbuf) {
-            if(pbuf[0] == '.') {
-                pbuf++;
-            }
-            fputs(pbuf, fp);
-            pbuf = strtok(NULL, "\n");
+        PROBE4(body_end, *sock, segment->msgid, buflen - bufleft, ret);
+        tspan = trace_begin();
+        bytes = remove_dots(buf, buflen - bufleft, buf, buflen);
+        fwrite(buf, 1, bytes, fp);
+        trace_end("body_write", tspan, segment->number);
+        PROBE2(segment_write, segment->msgid, bytes);
+
+        if(g.cache && complete && ret == 0 && !lost) {
+            cache_store(segment->msgid, buf, bytes);
         }
     }
 
     fclose(fp);
+    pool_put(buf);
     
-    if(!g.running) {
-        unlink(filename);
+    if(ret == 0 && !complete) {
+        ret = NN_TIMEOUT;
+    }
+    if(!g.running || lost || ret < 0) {
+        unlink(tmpname);
+        ret = lost ? NN_LOST : ret;
+    }
+    else if(sched_claim(segment)) {
+        rename(tmpname, filename);
+    }
+    else {
+        unlink(tmpname);
+        ret = NN_LOST;
     }
     
+    trace_end("get_segment", tseg, segment->number);
     return ret;
 }
 
@@ -736,6 +946,7 @@ int stat_msg(int* sock, char* msgid) {
     int rc;
 
     snprintf(buf, sizeof(buf), "STAT <%s>\r\n", msgid);
+    PROBE2(stat_start, *sock, msgid);
     if(send_msg(*sock, buf, strlen(buf), 0) < 0) {
         fprintf(stderr, "%s: error sending STAT command\n", __FUNCTION__);
         return NN_ERROR;
@@ -744,7 +955,9 @@ int stat_msg(int* sock, char* msgid) {
         fprintf(stderr, "%s: error receiving STAT response\n", __FUNCTION__);
         return NN_ERROR;
     }
-    if((rc = check_response_status(buf)) == NNTP_STAT_OK) {
+    rc = check_response_status(buf);
+    PROBE3(stat_end, *sock, msgid, rc);
+    if(rc == NNTP_STAT_OK) {
         return 0;
     }
     else if(rc == NNTP_NO_SUCH_ARTICLE) {
@@ -775,75 +988,179 @@ int verify_file(int* sock, file_node* file) {
         else {
             seg_verified++;
             //printf("%s: msg OK [%s]\n", __FUNCTION__, segment->msgid);
-            printf("\r%s: %d/%d", __FUNCTION__, seg_verified, seg_count);
         }
+        __sync_fetch_and_add(&g.stats.done_segments, 1);
+        __sync_fetch_and_add(&g.stats.done_bytes, segment->bytes);
         segment = segment->next;
     }
-    printf("\n");
+    printf("%s: %d/%d segments available\n", __FUNCTION__, seg_verified, seg_count);
     return seg_count - seg_verified;
 }
 
-int get_file(int* sock, file_node* file) {
+/* Decode a file once all of its segments are resolved and mark it done */
+int finish_file(file_node* file) {
     int rc;
-    segment_node* segment = NULL;
     char buf[256];
     char statfile[256];
     FILE* fp = NULL;
-    struct stat fileinfo;
     
     snprintf(statfile, sizeof(statfile), "%s/.%s.done", g.outdir, file->filename);
 
     printf("%s: [%s]\n", __FUNCTION__, file->subject);
 
-    if(stat(g.outdir,  &fileinfo) != 0) {
-        if(errno == ENOENT) {
-            mkdir(g.outdir, 0755);
-        }
+    if((rc = decode_file(file))) {
+        printf("%s: %d segments decoded\n", __FUNCTION__, rc);
     }
 
-    /* check if file already done */
-    if(stat(statfile, &fileinfo) == 0) {
-        printf("%s: file already finished\n", __FUNCTION__);
-        return NN_OK;
-    }
-    
-    if(set_group(sock, file->group) < 0) {
-        fprintf(stderr, "%s: error changing to group %s\n", __FUNCTION__, file->group);
+    if((fp = fopen(statfile, "w")) == NULL) {
+        perror("fopen");
         return NN_ERROR;
     }
+    snprintf(buf, sizeof(buf), "%lu", time(NULL));
+    fwrite(buf, 1, strlen(buf), fp);
+    fclose(fp);
+    fp = NULL;
+    file->done = 1;
+    return NN_OK;
+}
 
-    segment = file->segments;
-    while(segment && g.running) {
-        if(get_segment(sock, file, segment) < 0) {
-            printf("%s: segment download failed [msgid=%s]\n", __FUNCTION__, segment->msgid);
-            segment->done = 0;
-        }
-        else {
-            segment->done = 1;
+/* Resolve the segments that share this segment's msgid by copying its
+ * segment file */
+void resolve_dups(segment_node* segment) {
+    segment_node* dup;
+    char src[1024];
+    char dst[1024];
+    int rc;
+
+    snprintf(src, sizeof(src), "%s/.%s.%u", g.outdir, segment->file->filename, segment->number);
+    for(dup = segment->dups; dup; dup = dup->dup_next) {
+        snprintf(dst, sizeof(dst), "%s/.%s.%u", g.outdir, dup->file->filename, dup->number);
+        rc = segment->done && (file_exists(dst) || copy_file(src, dst) == NN_OK) ? 1 : NN_ERROR;
+        rc = sched_done(dup, NULL, rc, 0);
+        stream_wake(dup->file);
+        if(rc == 1 && g.running && !g.stream) {
+            postproc_submit(dup->file);
         }
-        segment = segment->next;
     }
-    
-    if(g.running) {
-        if((rc = decode_file(file))) {
-            printf("%s: %d segments decoded\n", __FUNCTION__, rc);
+}
+
+/* One per server connection: pulls segments from the scheduler until the
+ * job runs dry */
+void* connection_thread(void* arg) {
+    connection* conn = (connection*)arg;
+    segment_node* segment = NULL;
+    file_node* file = NULL;
+    unsigned long long tspan;
+    char name[32];
+    int failures = 0;
+    int rc;
+
+    current = conn;
+    snprintf(name, sizeof(name), "conn %d", conn->id);
+    trace_thread_name(name);
+    conn->sock = -1;
+
+    while(g.running) {
+        /* above the server's current target: log out and wait */
+        if(conn->slot >= conn->server->target) {
+            if(conn->sock != -1) {
+                server_disconnect(&conn->sock);
+            }
+            if(!connctl_wait(conn)) {
+                break;
+            }
+        }
+        if(conn->sock == -1) {
+            tspan = trace_begin();
+            conn->sock = server_connect(conn->server, 3);
+            trace_end("server_connect", tspan, conn->id);
+            if(conn->sock == -1) {
+                progress_message(stderr, "%s: [%d] error connecting to %s\n", __FUNCTION__,
+                    conn->id, conn->server->host);
+                if(!g.auto_connections) {
+                    break;
+                }
+                if(++failures >= CONNECT_FAILURES) {
+                    progress_message(stderr, "%s: [%d] giving up on %s\n", __FUNCTION__,
+                        conn->id, conn->server->host);
+                    connctl_unreachable(conn->server);
+                    break;
+                }
+                connctl_error(conn->server);
+                sleep(1);
+                continue;
+            }
+            failures = 0;
+            conn->group[0] = '\0';
+        }
+        if((segment = sched_next(conn->server)) == NULL) {
+            break;
+        }
+        file = segment->file;
+        if(strcmp(conn->group, file->group)) {
+            tspan = trace_begin();
+            rc = set_group(&conn->sock, file->group);
+            trace_end("set_group", tspan, conn->id);
+            if(rc < 0) {
+                progress_message(stderr, "%s: error changing to group %s\n", __FUNCTION__, file->group);
+                conn->group[0] = '\0';
+            }
+            else {
+                strncpy(conn->group, file->group, sizeof(conn->group));
+            }
         }
 
-        if((fp = fopen(statfile, "w")) == NULL) {
-            perror("fopen");
+        tspan = trace_now();
+        if((rc = get_segment(&conn->sock, file, segment)) >= 0 && g.probe && !file->size) {
+            probe_segment(segment);
         }
-        else {
-            snprintf(buf, sizeof(buf), "%lu", time(NULL));
-            fwrite(buf, 1, strlen(buf), fp);
-            fclose(fp);
-            fp = NULL;
+        else if(rc == NN_LOST) {
+            conn->group[0] = '\0';
+        }
+        else if(rc == NN_MISSING) {
+            progress_message(stdout, "%s: article not on %s [msgid=%s]\n", __FUNCTION__,
+                conn->server->host, segment->msgid);
+        }
+        else if(rc < 0) {
+            progress_message(stdout, "%s: segment download failed [msgid=%s]\n", __FUNCTION__, segment->msgid);
+            if(rc == NN_TIMEOUT) {
+                connctl_error(conn->server);
+            }
+            /* the segment is retried elsewhere; start this connection over */
+            if(g.running && conn->sock != -1) {
+                connection_reset(&conn->sock);
+                conn->group[0] = '\0';
+            }
+        }
+
+        if((rc = sched_done(segment, conn->server, rc, trace_now() - tspan)) >= 0) {
+            resolve_dups(segment);
+            stream_wake(file);
+            /* a streamed file is decoded by the stream writer */
+            if(rc == 1 && g.running && !g.stream) {
+                postproc_submit(file);
+            }
         }
     }
-    return NN_OK;
+
+    if(conn->sock != -1 && server_disconnect(&conn->sock) == -1) {
+        progress_message(stderr, "%s: [%d] error disconnecting from server\n", __FUNCTION__, conn->id);
+    }
+    sched_leave(conn->server);
+    return NULL;
 }
 
 void print_usage() {
-    printf("usage: nzbnews [-s server] [-u username] [-p password] [-v] [-o directory] <nzbfile>\n");
+    printf("usage: nzbnews [-s server] [-u username] [-p password] [-v] [-o directory]\n"
+           "               [-n connections] [-A] [-q] [-R] [-y] [-P order|par2|smallest|interleave]\n"
+           "               [-j postproc workers] [-m memory MB] [-C cache dir]\n"
+           "               [-H hedge factor] [-T tracefile] [-W record file]\n"
+           "               [-X replay file [-F]] [-K job control file] <nzbfile> ...\n"
+           "       nzbnews -O file number|subject [-Y fifo] [options] <nzbfile> ...\n"
+           "       nzbnews -V samples per file [options] <nzbfile> ...\n"
+           "       nzbnews -G group [-r first-last] [options] [nzbfile to write]\n"
+           "       nzbnews -G group -D dbdir [-r first-last] [options]\n"
+           "       nzbnews -G group -D dbdir -S query [-L] [options]\n");
     return;
 }
 
@@ -874,16 +1191,66 @@ int init(int argc, char* argv[]) {
     g.outdir = NULL;
     g.verify = 0;
     g.anonymous = 0;
+    g.connections = 1;
+    g.schedule = SCHED_PAR2;
+    g.postproc_workers = 1;
+    g.postproc_queue = 0;
     g.stats.start = time(NULL);
-    g.stats.last = g.stats.start;
     g.stats.bytes = 0;
-    g.stats.last_bytes = 0;
     
-    while((opt = getopt(argc, argv, "avhxs:u:p:o:c:")) != EOF) {
+    while((opt = getopt(argc, argv, "aAqRLFyvhxs:u:p:o:c:n:P:j:m:C:H:T:G:r:D:S:W:X:K:O:Y:V:")) != EOF) {
         switch(opt) {
         case 'a':
             g.anonymous = 1;
             break;
+        case 'A':
+            g.auto_connections = 1;
+            break;
+        case 'q':
+            g.progress = PROGRESS_QUIET;
+            break;
+        case 'R':
+            g.par2_ondemand = 1;
+            break;
+        case 'G':
+            g.index_group = strdup(optarg);
+            break;
+        case 'D':
+            g.header_db = strdup(optarg);
+            break;
+        case 'S':
+            g.search = strdup(optarg);
+            break;
+        case 'L':
+            g.list_only = 1;
+            break;
+        case 'W':
+            g.record = strdup(optarg);
+            break;
+        case 'X':
+            g.replay = strdup(optarg);
+            break;
+        case 'F':
+            g.replay_fast = 1;
+            break;
+        case 'y':
+            g.probe = 1;
+            break;
+        case 'K':
+            g.control = strdup(optarg);
+            break;
+        case 'O':
+            g.stream = strdup(optarg);
+            break;
+        case 'Y':
+            g.stream_output = strdup(optarg);
+            break;
+        case 'r':
+            if(sscanf(optarg, "%lu-%lu", &g.index_first, &g.index_last) < 1) {
+                print_usage();
+                exit(1);
+            }
+            break;
         case 'x':
             g.debug++;
             break;
@@ -905,6 +1272,34 @@ int init(int argc, char* argv[]) {
         case 'v':
             g.verify = 1;
             break;
+        case 'V':
+            g.verify = 1;
+            g.verify_samples = atoi(optarg);
+            break;
+        case 'n':
+            g.connections = atoi(optarg);
+            break;
+        case 'j':
+            g.postproc_workers = atoi(optarg);
+            break;
+        case 'm':
+            g.memory = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'C':
+            g.cache = strdup(optarg);
+            break;
+        case 'H':
+            g.hedge = atof(optarg);
+            break;
+        case 'T':
+            g.trace = strdup(optarg);
+            break;
+        case 'P':
+            if((g.schedule = sched_policy(optarg)) < 0) {
+                print_usage();
+                exit(1);
+            }
+            break;
         case 'h':
         default:
             print_usage();
@@ -912,7 +1307,20 @@ int init(int argc, char* argv[]) {
             break;
         }
     }
-    g.nzbfile = strdup(argv[optind]);
+    if(optind < argc) {
+        g.nzbfile = strdup(argv[optind]);
+        if((g.nzbfiles = (char**)calloc(argc - optind, sizeof(char*))) == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        while(optind < argc) {
+            g.nzbfiles[g.nnzbfiles++] = strdup(argv[optind++]);
+        }
+    }
+    else if(!g.index_group) {
+        print_usage();
+        exit(1);
+    }
 
     // Default values
     if(!g.outdir) {
@@ -934,6 +1342,7 @@ int init(int argc, char* argv[]) {
     FILE* fp = NULL;
     char *p = NULL;
     char *key = NULL, *val = NULL;
+    server_node *backup = NULL;     /* keys after backup_server= apply to it */
 
     if(stat(g.config, &finfo) == -1) {
         return NN_ERROR;
@@ -960,7 +1369,21 @@ int init(int argc, char* argv[]) {
             while(*key == ' ' || *key == '\t') { key++; }
             while(*val == ' ' || *val == '\t') { val++; }
 
-            if(!strcasecmp(key, "server")) {
+            if(!strcasecmp(key, "backup_server")) {
+                backup = server_add(val);
+            }
+            else if(backup && !strcasecmp(key, "username")) {
+                free(backup->username);
+                backup->username = strdup(val);
+            }
+            else if(backup && !strcasecmp(key, "password")) {
+                free(backup->password);
+                backup->password = strdup(val);
+            }
+            else if(backup && !strcasecmp(key, "connections")) {
+                backup->max = atoi(val);
+            }
+            else if(!strcasecmp(key, "server")) {
                 if(g.server) {
                     free(g.server);
                 }
@@ -978,6 +1401,101 @@ int init(int argc, char* argv[]) {
                 }
                 g.password = strdup(val);
             }
+            else if(!strcasecmp(key, "connections")) {
+                g.connections = atoi(val);
+            }
+            else if(!strcasecmp(key, "timeout")) {
+                g.timeout = atoi(val);
+            }
+            else if(!strcasecmp(key, "index_chunk")) {
+                g.index_chunk = strtoul(val, NULL, 10);
+            }
+            else if(!strcasecmp(key, "control")) {
+                if(!g.control) {
+                    g.control = strdup(val);
+                }
+            }
+            else if(!strcasecmp(key, "stream_output")) {
+                if(!g.stream_output) {
+                    g.stream_output = strdup(val);
+                }
+            }
+            else if(!strcasecmp(key, "stream_window")) {
+                g.stream_window = atoi(val);
+            }
+            else if(!strcasecmp(key, "record")) {
+                if(!g.record) {
+                    g.record = strdup(val);
+                }
+            }
+            else if(!strcasecmp(key, "replay")) {
+                if(!g.replay) {
+                    g.replay = strdup(val);
+                }
+            }
+            else if(!strcasecmp(key, "replay_fast")) {
+                g.replay_fast = atoi(val);
+            }
+            else if(!strcasecmp(key, "header_db")) {
+                if(!g.header_db) {
+                    g.header_db = strdup(val);
+                }
+            }
+            else if(!strcasecmp(key, "verify_samples")) {
+                if(!g.verify_samples) {
+                    g.verify_samples = atoi(val);
+                }
+            }
+            else if(!strcasecmp(key, "probe")) {
+                g.probe = atoi(val);
+            }
+            else if(!strcasecmp(key, "par2_ondemand")) {
+                g.par2_ondemand = atoi(val);
+            }
+            else if(!strcasecmp(key, "auto_connections")) {
+                g.auto_connections = atoi(val);
+            }
+            else if(!strcasecmp(key, "trace")) {
+                if(!g.trace) {
+                    g.trace = strdup(val);
+                }
+            }
+            else if(!strcasecmp(key, "cache")) {
+                if(!g.cache) {
+                    g.cache = strdup(val);
+                }
+            }
+            else if(!strcasecmp(key, "cache_size")) {
+                g.cache_size = strtoull(val, NULL, 10) * 1024 * 1024;
+            }
+            else if(!strcasecmp(key, "hedge")) {
+                g.hedge = atof(val);
+            }
+            else if(!strcasecmp(key, "memory")) {
+                g.memory = strtoul(val, NULL, 10) * 1024 * 1024;
+            }
+            else if(!strcasecmp(key, "postproc_workers")) {
+                g.postproc_workers = atoi(val);
+            }
+            else if(!strcasecmp(key, "postproc_queue")) {
+                g.postproc_queue = atoi(val);
+            }
+            else if(!strcasecmp(key, "progress")) {
+                if(progress_mode(val) < 0) {
+                    fprintf(stderr, "%s: Unknown progress mode [%s]\n", __FUNCTION__, val);
+                }
+                else if(g.progress == PROGRESS_AUTO) {
+                    g.progress = progress_mode(val);
+                }
+            }
+            else if(!strcasecmp(key, "schedule")) {
+                if(sched_policy(val) < 0) {
+                    fprintf(stderr, "%s: Unknown schedule [%s]\n", __FUNCTION__, val);
+                }
+                else {
+                    g.schedule = sched_policy(val);
+                }
+            }
             else {
                 fprintf(stderr, "%s: Unknown configuration key [%s = %s]\n",
                     __FUNCTION__, key, val);
@@ -987,10 +1505,20 @@ int init(int argc, char* argv[]) {
     fclose(fp);
 }
 
-    setvbuf(stdout, NULL, _IONBF, 0);
+    if(g.trace) {
+        trace_init();
+    }
+    if(g.replay && session_replay(g.replay, g.replay_fast) < 0) {
+        exit(1);
+    }
+    if(g.record && session_record(g.record) < 0) {
+        exit(1);
+    }
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    /* a dropped connection shows up as an error from send_msg() */
+    signal(SIGPIPE, SIG_IGN);
 
     g.running = 1;
 
@@ -1013,27 +1541,116 @@ void cleanup(void) {
     if(g.nzbfile) {
         free(g.nzbfile); g.nzbfile = NULL;
     }
+    while(g.nnzbfiles > 0) {
+        free(g.nzbfiles[--g.nnzbfiles]);
+    }
+    if(g.nzbfiles) {
+        free(g.nzbfiles); g.nzbfiles = NULL;
+    }
+    if(g.control) {
+        free(g.control); g.control = NULL;
+    }
+    if(g.stream) {
+        free(g.stream); g.stream = NULL;
+    }
+    if(g.stream_output) {
+        free(g.stream_output); g.stream_output = NULL;
+    }
     if(g.outdir) {
         free(g.outdir); g.outdir = NULL;
     }
+    if(g.trace) {
+        free(g.trace); g.trace = NULL;
+    }
+    if(g.cache) {
+        free(g.cache); g.cache = NULL;
+    }
+    if(g.index_group) {
+        free(g.index_group); g.index_group = NULL;
+    }
+    if(g.header_db) {
+        free(g.header_db); g.header_db = NULL;
+    }
+    if(g.search) {
+        free(g.search); g.search = NULL;
+    }
+    session_cleanup();
+    image_cleanup();
+    if(g.record) {
+        free(g.record); g.record = NULL;
+    }
+    if(g.replay) {
+        free(g.replay); g.replay = NULL;
+    }
+    while(g.servers) {
+        server_node* server = g.servers;
+        g.servers = server->next;
+        free(server->host);
+        free(server->username);
+        free(server->password);
+        free(server->conns);
+        free(server);
+    }
 }
 
+#ifndef NZBNEWS_NO_MAIN
 int main(int argc, char* argv[])
 {
     int sock = -1;
     file_node*  file_list = NULL;
+    file_node** lists = NULL;
+    int         nlists = 0;
+    file_node*  stream = NULL;
     file_node*  file = NULL;
+    server_node* server = NULL;
+    struct stat fileinfo;
     char *p = NULL;
     char buf[1024];
+    int ret = 0;
+    int i, j;
 
     init(argc, argv);
 
+    // a search of the header database stands in for the NZB
+    if(g.search) {
+        if(!g.index_group || !g.header_db) {
+            fprintf(stderr, "%s: -S needs -G and -D (or header_db=)\n", __FUNCTION__);
+            exit(1);
+        }
+        if((file_list = hdrdb_file_list(g.header_db, g.index_group, g.search)) == NULL) {
+            fprintf(stderr, "%s: nothing to download\n", __FUNCTION__);
+            exit(1);
+        }
+        if(g.list_only) {
+            for(file = file_list; file; file = file->next) {
+                segment_node* segment;
+                unsigned long bytes = 0;
+
+                for(i = 0, segment = file->segments; segment; segment = segment->next, i++) {
+                    bytes += segment->bytes;
+                }
+                printf("%8.1f MB %5d segments  %s\n", bytes / (1024.0 * 1024.0), i, file->subject);
+            }
+            del_file_list(file_list);
+            cleanup();
+            return 0;
+        }
+    }
+
+    // a replayed session needs no real server
+    if(g.replay) {
+        if(!g.server)   { g.server = strdup("replay"); }
+        if(!g.username) { g.username = strdup(""); }
+        if(!g.password) { g.password = strdup(""); }
+    }
+
     // get required information from the user
     while(!g.server
         || !g.username
         || !g.password) {
         if(!g.server) {
             printf("You must specify a server: ");
+            fflush(stdout);
             fgets(buf, sizeof(buf), stdin);
             g.server = strdup(buf);
             //fscanf(stdin, "%s", g.server);
@@ -1041,6 +1658,7 @@ int main(int argc, char* argv[])
         }
         if(!g.username) {
             printf("You must specify a username: ");
+            fflush(stdout);
             fgets(buf, sizeof(buf), stdin);
             g.username = strdup(buf);
             //fscanf(stdin, "%s", g.username);
@@ -1048,6 +1666,7 @@ int main(int argc, char* argv[])
         }
         if(!g.password) {
             printf("You must specify a password: ");
+            fflush(stdout);
             fgets(buf, sizeof(buf), stdin);
             g.password = strdup(buf);
             //fscanf(stdin, "%s", g.password);
@@ -1059,36 +1678,178 @@ int main(int argc, char* argv[])
     if((p = strchr(g.username, '\n')) != NULL)  { *p = '\0'; }
     if((p = strchr(g.password, '\n')) != NULL)  { *p = '\0'; }
 
-    // begin processing
-    if((file_list = get_file_list(g.nzbfile)) == NULL) {
-        fprintf(stderr, "%s: failed to get file list\n", __FUNCTION__);
-        exit(1);
+    // the primary server goes first, backups from the config follow
+    server = g.servers;
+    g.servers = NULL;
+    server_add(g.server)->next = server;
+    g.servers->username = strdup(g.username);
+    g.servers->password = strdup(g.password);
+    g.servers->max = g.connections < 1 ? 1 : g.connections;
+    for(i = 0, server = g.servers; server; server = server->next) {
+        server->id = i++;
+        if(server->max < 1) {
+            server->max = 1;
+        }
+        if(!server->username) {
+            server->username = strdup(g.username);
+        }
+        if(!server->password) {
+            server->password = strdup(g.password);
+        }
     }
-    if((sock = server_connect(3)) == -1) {
-        fprintf(stderr, "%s: error connecting to server\n", __FUNCTION__);
+
+    if(g.index_group && !g.search) {
+        if(!g.nzbfile && !g.header_db) {
+            snprintf(buf, sizeof(buf), "%s/%s.nzb", g.outdir, g.index_group);
+            g.nzbfile = strdup(buf);
+        }
+        if(g.connections < 1) {
+            g.connections = 1;
+        }
+        i = index_group(g.index_group, g.nzbfile, g.index_first, g.index_last);
+        trace_dump();
+        cleanup();
+        return i == NN_OK ? 0 : 1;
+    }
+
+    // begin processing; every NZB is a job of its own
+    if((lists = (file_node**)calloc(g.nnzbfiles + 1, sizeof(file_node*))) == NULL) {
+        perror("calloc");
         exit(1);
     }
-    file = file_list;
-    while(file && g.running) {
-        if(g.verify) {
-            verify_file(&sock, file);   
+    if(file_list) {
+        lists[nlists++] = file_list;
+    }
+    for(i = 0; !file_list && i < g.nnzbfiles; i++) {
+        if((lists[nlists++] = get_file_list(g.nzbfiles[i])) == NULL) {
+            fprintf(stderr, "%s: failed to get file list [%s]\n", __FUNCTION__, g.nzbfiles[i]);
+            exit(1);
         }
-        else {
-            get_file(&sock, file);
+    }
+    if(g.verify) {
+        if(g.verify_samples && g.verify_samples < 3) {
+            printf("%s: sampling 3 segments per file, the first, the last and one between\n", __FUNCTION__);
+            g.verify_samples = 3;
+        }
+        if((sock = server_connect(g.servers, 3)) == -1) {
+            fprintf(stderr, "%s: error connecting to server\n", __FUNCTION__);
+            exit(1);
+        }
+        for(j = 0; j < nlists; j++) {
+            for(file = lists[j]; file; file = file->next) {
+                segment_node* segment;
+
+                for(i = 0, segment = file->segments; segment; segment = segment->next, i++) {
+                    g.stats.total_bytes += segment->bytes;
+                    g.stats.total_segments += !g.verify_samples || i < g.verify_samples;
+                }
+            }
+        }
+        progress_start(g.progress);
+        if(g.verify_samples) {
+            ret = sample_verify(&sock, lists, nlists, g.verify_samples);
+        }
+        for(j = 0; !g.verify_samples && j < nlists; j++) {
+            file = lists[j];
+            while(file && g.running) {
+                verify_file(&sock, file);   
+                file = file->next;
+            }
+        }
+        progress_stop();
+        if(server_disconnect(&sock) == -1) {
+            fprintf(stderr, "%s: error disconnecting from server\n", __FUNCTION__);
+        }
+    }
+    else {
+        if(stat(g.outdir, &fileinfo) != 0) {
+            if(errno == ENOENT) {
+                mkdir(g.outdir, 0755);
+            }
+        }
+        pool_init(g.memory);
+        if(g.cache && cache_init(g.cache, g.cache_size) < 0) {
+            fprintf(stderr, "%s: disabling article cache\n", __FUNCTION__);
+            free(g.cache); g.cache = NULL;
         }
-        file = file->next;
+        sched_init(g.schedule);
+        if(g.stream) {
+            // only the selected file, taken out of its list into one of its own
+            for(j = 0; !stream && j < nlists; j++) {
+                stream = stream_select(&lists[j], g.stream);
+            }
+            if(!stream) {
+                fprintf(stderr, "%s: no file matches [%s]\n", __FUNCTION__, g.stream);
+                exit(1);
+            }
+            if(stream_open(stream, g.stream_output,
+                g.stream_window ? g.stream_window : 4 * g.connections) < 0) {
+                exit(1);
+            }
+            sched_add(stream, g.stream);
+        }
+        for(j = 0; !g.stream && j < nlists; j++) {
+            if(g.search) {
+                sched_add(lists[j], g.search);
+            }
+            else {
+                p = strrchr(g.nzbfiles[j], '/');
+                sched_add(lists[j], p ? p + 1 : g.nzbfiles[j]);
+            }
+        }
+        if(postproc_init(g.postproc_workers,
+            g.postproc_queue ? g.postproc_queue : 2 * g.postproc_workers) < 0) {
+            exit(1);
+        }
+        connctl_start();
+        for(i = 0, server = g.servers; server; server = server->next) {
+            if((server->conns = (connection*)calloc(server->max, sizeof(connection))) == NULL) {
+                perror("calloc");
+                exit(1);
+            }
+            for(j = 0; j < server->max; j++) {
+                server->conns[j].id = i++;
+                server->conns[j].slot = j;
+                server->conns[j].sock = -1;
+                server->conns[j].server = server;
+                if(pthread_create(&server->conns[j].thread, NULL, connection_thread, &server->conns[j]) != 0) {
+                    perror("pthread_create");
+                    exit(1);
+                }
+            }
+        }
+        progress_start(g.progress);
+        for(server = g.servers; server; server = server->next) {
+            for(j = 0; j < server->max; j++) {
+                pthread_join(server->conns[j].thread, NULL);
+            }
+        }
+        progress_stop();
+        connctl_stop();
+        if(g.stream) {
+            stream_finish();
+        }
+        postproc_finish();
+        pool_cleanup();
+        if(g.cache) {
+            cache_cleanup();
+        }
+        sched_cleanup();
     }
-    if(server_disconnect(&sock) == -1) {
-        fprintf(stderr, "%s: error disconnecting from server\n", __FUNCTION__);
+    for(j = 0; j < nlists; j++) {
+        del_file_list(lists[j]);
     }
-    del_file_list(file_list);
+    del_file_list(stream);
+    free(lists);
 
+    trace_dump();
     cleanup();
 
     printf("%.2f MB transferred in %lu seconds (%.2f kB/s)\n",
         g.stats.bytes/(1024.0 * 1024.0),
         time(NULL) - g.stats.start,
-        g.stats.rate/1000);
+        g.stats.bytes / (time(NULL) > g.stats.start ? time(NULL) - g.stats.start : 1) / 1000.0);
     
-    return 0;
+    return ret;
 }
+#endif
@@ -1,8 +1,53 @@
 #ifndef NZBNEWS_H
 #define NZBNEWS_H
 
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
 #define DECODE_CMD "nice -n 10 uudeview -i -a -m -d -s -s -q " 
 
+#define NN_OK           0
+#define NN_ERROR        -1
+#define NN_TIMEOUT      -2
+#define NN_UNKNOWN      -3
+#define NN_LOST         -4      /* another attempt at the segment won */
+#define NN_MISSING      -5      /* 430, the server does not have the article */
+
+#define DEBUG   if(g.debug >= 1) printf
+#define DEBUG2  if(g.debug >= 2) printf
+#define DEBUG3  if(g.debug >= 3) printf
+#define DEBUG4  if(g.debug >= 4) printf
+
+/* USDT probes for perf, bpftrace and SystemTap, e.g.
+ *
+ *  bpftrace -e 'usdt:./nzbnews:nzbnews:body_end { @[arg3] = hist(arg2); }'
+ *
+ * Each compiles to a single nop when sys/sdt.h is present (the Makefile
+ * defines HAVE_SYS_SDT_H) and to nothing otherwise.
+ *
+ *  cmd_send(sock, buf, len)            response(code, buf)
+ *  body_start(sock, msgid, bytes)      body_end(sock, msgid, bytes, rc)
+ *  segment_write(msgid, bytes)         stat_start(sock, msgid)
+ *  stat_end(sock, msgid, code)         decode_start(filename, index)
+ *  decode_end(filename, files)         conn_open(sock, host)
+ *  conn_close(sock)                    conn_reset(sock)
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE(name)                 DTRACE_PROBE(nzbnews, name)
+#define PROBE1(name, a)             DTRACE_PROBE1(nzbnews, name, a)
+#define PROBE2(name, a, b)          DTRACE_PROBE2(nzbnews, name, a, b)
+#define PROBE3(name, a, b, c)       DTRACE_PROBE3(nzbnews, name, a, b, c)
+#define PROBE4(name, a, b, c, d)    DTRACE_PROBE4(nzbnews, name, a, b, c, d)
+#else
+#define PROBE(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#define PROBE4(name, a, b, c, d)
+#endif
+
 #define NNTP_HELP_OK            100
 #define NNTP_READY              200
 #define NNTP_READY_NO_POSTING   201
@@ -12,6 +57,7 @@
 #define NNTP_ARTICLE_OK         220
 #define NNTP_HEAD_OK            221
 #define NNTP_BODY_OK            222
+#define NNTP_OVERVIEW_OK        224
 #define NNTP_STAT_OK            223
 #define NNTP_AUTHINFO_OK        250
 #define NNTP_AUTHINFO_OK2       281
@@ -20,6 +66,7 @@
 #define NNTP_NO_SUCH_GROUP      411
 #define NNTP_NO_GROUP_SELECTED  412
 #define NNTP_NO_ARTICLE_SELECTED    420
+#define NNTP_NO_ARTICLES_IN_RANGE   423
 #define NNTP_NO_SUCH_ARTICLE    430
 #define NNTP_AUTH_REQUIRED      450
 #define NNTP_AUTH_REJECTED      452
@@ -33,12 +80,48 @@ typedef struct _chunk {
 	unsigned char* data;
 } chunk;
 
+/* file classes, used by the scheduler to order downloads */
+#define FILE_PAR2_INDEX     0
+#define FILE_DATA           1
+#define FILE_PAR2_VOL       2
+
+/* scheduling policies */
+#define SCHED_ORDER         0   /* NZB document order */
+#define SCHED_PAR2          1   /* par2 index first, recovery volumes last */
+#define SCHED_SMALLEST      2   /* as SCHED_PAR2, smallest files first */
+#define SCHED_INTERLEAVE    3   /* as SCHED_PAR2, round-robin segments across files */
+
+/* session recording events */
+#define SESSION_CONNECT     'C'
+#define SESSION_SEND        'S'
+#define SESSION_RECV        'R'
+#define SESSION_TIMEOUT     'T'
+#define SESSION_ERROR       'E'
+
+/* progress modes */
+#define PROGRESS_AUTO       0   /* status line on a terminal, else quiet */
+#define PROGRESS_OFF        1
+#define PROGRESS_TTY        2
+#define PROGRESS_QUIET      3   /* periodic key=value lines */
+
 typedef struct _segment_node {
 	struct _segment_node*	next;
+	struct _file_node*	file;
 	unsigned int	bytes;
 	unsigned int	number;
 	char	        msgid[512];
 	short			done;
+	short			resolved;
+	short			won;            /* an attempt has the complete article */
+	short			attempts;       /* attempts in flight */
+	unsigned long long	started;
+	short			failures;       /* transient failures so far */
+	unsigned int	tried;          /* bit per server that answered 430 */
+	unsigned long long	not_before;     /* earliest retry, trace_now() time */
+	struct _segment_node*	retry_next;
+	short			dup;            /* same msgid as an earlier segment */
+	struct _segment_node*	dups;       /* later segments with this msgid */
+	struct _segment_node*	dup_next;
 	chunk*			chunks;
 } segment_node;
 
@@ -49,30 +132,281 @@ typedef struct _file_node {
 	time_t			date;
 	char	subject[256];
 	char	filename[128];
+	char	name[256];          /* real filename, taken from the subject */
 	short			done;
+	short			type;
+	int				index;      /* position in the NZB */
+	int				job;        /* which NZB, for the scheduler */
+	unsigned long	bytes;
+	int				pending;    /* segments not yet resolved */
+	unsigned long long	size;       /* decoded size from the -y probe, 0 if unknown */
+	segment_node*	cursor;     /* next segment to dispatch */
 	segment_node* 	segments;
 } file_node;
 
-/* nzbnews.c */
+typedef struct _yenc_info {
+	short			found;
+	short			ended;
+	short			has_pcrc32;
+	char			name[256];
+	unsigned int	part;
+	unsigned long	size;
+	unsigned long	begin;
+	unsigned long	end;
+	unsigned long	pcrc32;
+	unsigned long	crc32;      /* computed over the decoded data */
+	unsigned long	bytes;
+} yenc_info;
+
+/* one overview line, fields pointing into the receive buffer */
+typedef struct _index_header {
+	unsigned long	article;
+	char*			subject;
+	char*			poster;
+	time_t			date;
+	char*			msgid;          /* without the angle brackets */
+	unsigned long	bytes;
+} index_header;
+
+typedef struct _server_node {
+	struct _server_node*	next;
+	int				id;
+	char*			host;
+	int				port;
+	char*			username;
+	char*			password;
+	int				max;            /* connection limit for this server */
+	int				target;         /* connections wanted right now */
+	unsigned long	bytes;          /* received, for the connection controller */
+	unsigned long	errors;         /* 400s and timeouts */
+	short			unreachable;    /* a connection gave up connecting to it */
+	struct {
+		unsigned long	bytes;
+		unsigned long	errors;
+		double			goodput;
+		short			increased;
+	} ctl;
+	struct _connection*	conns;
+} server_node;
+
+typedef struct _connection {
+	int				id;
+	int				slot;           /* index within its server */
+	int				sock;
+	char			group[256];
+	server_node*	server;
+	pthread_t		thread;
+	unsigned long	bytes;          /* received on this connection */
+	unsigned long	last_bytes;     /* the rest is kept by the progress thread */
+	double			rate;
+} connection;
+
+typedef struct _global_t {
+    short running;
+    short debug;
+    short verify;
+    int verify_samples;         /* -V: STAT only this many segments per file */
+    short anonymous;
+    short schedule;
+    short auto_connections;
+    short progress;
+    short par2_ondemand;        /* hold recovery volumes until the damage is known */
+    char *index_group;          /* -G: build an NZB from this group's overview */
+    unsigned long index_first;  /* article range for -G, 0 for the whole group */
+    unsigned long index_last;
+    unsigned long index_chunk;  /* articles per overview request */
+    char *header_db;            /* -D: directory of the local header database */
+    char *search;               /* -S: download the posts matching this */
+    short list_only;            /* -L: only list what -S matched */
+    char *record;               /* -W: record the session to this file */
+    char *replay;               /* -X: answer from this recording, no network */
+    short replay_fast;          /* -F: replay without the recorded delays */
+    short probe;                /* -y: fetch one segment of every file first */
+    char *stream;               /* -O: stream this file, by number or subject */
+    char *stream_output;        /* -Y: FIFO to stream to, else stdout */
+    int stream_window;          /* segments dispatched past the write cursor */
+    int connections;
+    int timeout;                /* fixed socket timeout in seconds, 0 for adaptive */
+    float hedge;                /* straggler factor for hedged requests, 0 for off */
+    int postproc_workers;
+    int postproc_queue;
+    size_t memory;              /* buffer pool cap in bytes, 0 for none */
+    char *config;
+    char *server;
+    char *username;
+    char *password;
+    char *nzbfile;
+    char **nzbfiles;            /* every NZB given, each one a job */
+    int nnzbfiles;
+    char *control;              /* -K: job priority/weight/pause file */
+    server_node *servers;       /* the first is -s/server=, then backups */
+    char *outdir;
+    char *trace;
+    char *cache;
+    unsigned long long cache_size;
+    struct {
+        time_t start;
+        unsigned long bytes;            /* received, updated atomically */
+        float rate;                     /* smoothed, set by the progress thread */
+        unsigned long total_bytes;      /* size of the job */
+        unsigned long done_bytes;       /* in resolved segments */
+        unsigned long total_segments;
+        unsigned long done_segments;
+        int queued;                     /* segments waiting for a connection */
+    } stats;
+} global_t;
+
+extern global_t g;
+
 /* nzbnews.c */
 int send_msg(int sock, char *buf, int len, int timeout);
 int recv_msg(int sock, char *buf, int len, int timeout);
 char *remove_dangerous_shell_chars(char *buf, size_t len);
+void file_set_filename(file_node *file);
 file_node *parse_nzb(char *nzbfile);
 file_node *get_file_list(char *file);
 int del_file_list(file_node *list);
 int decode_file(file_node *file);
 int server_login(int sock, char *username, char *password);
 int server_set_mode_reader(int sock);
-int server_connect(int retries);
+server_node *server_add(char *host);
+int server_connect(server_node *server, int retries);
 int server_disconnect(int* sock);
+char *find_terminator(char *buf, size_t len, size_t from);
 int remove_dots(char *src, size_t srclen, char *dst, int dstlen);
 int get_segment(int* sock, file_node *file, segment_node *segment);
 int set_group(int* sock, char *group);
-int get_file(int* sock, file_node *file);
+int finish_file(file_node *file);
+void resolve_dups(segment_node *segment);
+void *connection_thread(void *arg);
 void print_usage(void);
 int init(int argc, char *argv[]);
 int check_response_status(char *response);
+int stat_msg(int *sock, char *msgid);
 void signal_handler(int sig);
 
+/* sched.c */
+int sched_policy(char *name);
+void sched_classify(file_node *file);
+int sched_init(int policy);
+int sched_add(file_node *list, char *name);
+segment_node *sched_next(server_node *server);
+int sched_claim(segment_node *segment);
+int sched_done(segment_node *segment, server_node *server, int rc, unsigned long long ns);
+int sched_finished(void);
+void sched_leave(server_node *server);
+int sched_probed(file_node *file, char *name, unsigned long long size, unsigned long part,
+        unsigned long encoded);
+void sched_wake(void);
+void sched_par2_slice(file_node *file, unsigned long long slice);
+void sched_file_done(file_node *file);
+void sched_cleanup(void);
+
+/* connctl.c */
+void connctl_start(void);
+void connctl_stop(void);
+int connctl_wait(connection *conn);
+void connctl_error(server_node *server);
+void connctl_unreachable(server_node *server);
+
+/* par2.c */
+unsigned long long par2_scan(unsigned char *buf, size_t len);
+int par2_volume_blocks(char *name);
+unsigned long par2_damaged_blocks(file_node *file, unsigned long long slice);
+unsigned long par2_select(file_node **vols, int nvols, unsigned long deficit, char *pick);
+
+/* index.c */
+time_t index_date(char *str);
+int index_parse(char *buf, size_t len, index_header **hdrs, size_t *max);
+char *index_counter(char *subject, unsigned int *part, unsigned int *total);
+void index_add(index_header *hdrs, int n);
+int index_range(int *sock, char *group, unsigned long *first, unsigned long *last);
+int index_write_nzb(char *path, char *group);
+file_node *index_file_list(char *group);
+int index_group(char *group, char *path, unsigned long first, unsigned long last);
+
+/* hdrdb.c */
+int hdrdb_open(char *dir, char *group, int writable);
+unsigned long hdrdb_high_water(void);
+void hdrdb_set_high_water(unsigned long article);
+int hdrdb_append(index_header *hdrs, int n);
+int hdrdb_close(void);
+long hdrdb_search(char *query, unsigned int **matches);
+file_node *hdrdb_file_list(char *dir, char *group, char *query);
+
+/* session.c */
+int session_record(char *path);
+void session_log(int sock, int type, char *buf, int len);
+int session_replay(char *path, int fast);
+int session_connect(void);
+int session_send(int sock, char *buf, int len);
+int session_recv(int sock, char *buf, int len);
+void session_cleanup(void);
+
+/* stream.c */
+file_node *stream_select(file_node **list, char *pattern);
+int stream_open(file_node *file, char *path, int window);
+int stream_admit(segment_node *segment);
+void stream_wake(file_node *file);
+int stream_finish(void);
+
+/* probe.c */
+void probe_segment(segment_node *segment);
+int probe_fill(char *src, char *dst);
+
+/* sample.c */
+int sample_verify(int *sock, file_node **lists, int nlists, int samples);
+
+/* image.c */
+int image_owns(void *node);
+file_node *image_load(char *nzbfile);
+int image_write(char *nzbfile, file_node *list);
+void image_cleanup(void);
+
+/* rtt.c */
+void rtt_open(int sock);
+void rtt_sent(int sock);
+void rtt_received(int sock, int rc);
+long rtt_timeout(int sock, int timeout);
+
+/* progress.c */
+int progress_mode(char *name);
+void progress_start(int mode);
+void progress_stop(void);
+void progress_message(FILE *fp, char *fmt, ...);
+
+/* cache.c */
+unsigned long long cache_hash(char *str);
+int copy_file(char *src, char *dst);
+int cache_init(char *dir, unsigned long long max);
+int cache_fetch(char *msgid, char *dst);
+int cache_store(char *msgid, char *buf, size_t len);
+void cache_cleanup(void);
+
+/* pool.c */
+void pool_init(size_t cap);
+size_t pool_class_size(int cls);
+char *pool_get(size_t size, size_t *len);
+void pool_put(char *buf);
+char *pool_grow(char *buf, size_t used, size_t *len);
+void pool_cleanup(void);
+
+/* postproc.c */
+int postproc_init(int workers, int depth);
+int postproc_submit(file_node *file);
+int postproc_verify(file_node *file);
+void postproc_finish(void);
+
+/* trace.c */
+unsigned long long trace_now(void);
+void trace_init(void);
+void trace_thread_name(char *name);
+unsigned long long trace_begin(void);
+void trace_end(const char *name, unsigned long long start, long arg);
+int trace_dump(void);
+
+/* yenc.c */
+unsigned long crc32_update(unsigned long crc, const unsigned char *buf, size_t len);
+int yenc_decode(char *src, size_t len, unsigned char *dst, size_t dstlen, yenc_info *info);
+
 #endif
@@ -0,0 +1,156 @@
+/* On-demand PAR2 recovery volumes.
+ *
+ * With -R the .volNN+MM.par2 files are held back while the data files and
+ * the par2 index download.  The slice (block) size is read from the Main
+ * packet of the index as its segments are verified, and kept with the
+ * index's job.  Once every other file
+ * has been post-processed, the failed and CRC-damaged segments of the data
+ * files are turned into a count of damaged blocks, and the scheduler
+ * releases the set of volumes with the fewest bytes that carries at least
+ * that many recovery blocks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nzbnews.h"
+
+#define PAR2_MAGIC          "PAR2\0PKT"
+#define PAR2_MAIN           "PAR 2.0\0Main\0\0\0\0"
+#define PAR2_HEADER         64      /* magic, length, hash, set id, type */
+
+static unsigned long long get_le64(unsigned char* p) {
+    unsigned long long v = 0;
+    int i;
+
+    for(i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/* Look for a Main packet in decoded par2 data.  Returns its slice size, or
+ * 0 if there is none. */
+unsigned long long par2_scan(unsigned char* buf, size_t len) {
+    unsigned char* p;
+    unsigned long long slice;
+
+    for(p = buf; p + PAR2_HEADER + 8 <= buf + len; p++) {
+        if(*p == 'P' && !memcmp(p, PAR2_MAGIC, 8) && !memcmp(p + 48, PAR2_MAIN, 16)) {
+            slice = get_le64(p + PAR2_HEADER);
+            if(slice && !(slice & 3)) {
+                DEBUG("%s: slice size %llu\n", __FUNCTION__, slice);
+                return slice;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Number of recovery blocks in name.volNN+MM.par2, i.e. MM */
+int par2_volume_blocks(char* name) {
+    char* p;
+
+    if((p = strrchr(name, '+')) == NULL) {
+        return 0;
+    }
+    return atoi(p + 1);
+}
+
+/* Estimate the blocks of a data file lost to failed or damaged segments.
+ * Segment sizes are encoded sizes, a little over the data they carry, and
+ * every run of bad segments is assumed to straddle one extra block. */
+unsigned long par2_damaged_blocks(file_node* file, unsigned long long slice) {
+    segment_node* segment;
+    unsigned long long run = 0;
+    unsigned long blocks = 0;
+    unsigned long max;
+
+    for(segment = file->segments; segment; segment = segment->next) {
+        if(!segment->done) {
+            run += segment->bytes;
+            continue;
+        }
+        if(run) {
+            blocks += (run + slice - 1) / slice + 1;
+            run = 0;
+        }
+    }
+    if(run) {
+        blocks += (run + slice - 1) / slice + 1;
+    }
+    max = (file->bytes + slice - 1) / slice;
+    return blocks < max ? blocks : max;
+}
+
+/* Pick the volumes with the fewest bytes that together carry at least
+ * 'deficit' blocks; pick[i] is set for each chosen volume.  If all of them
+ * are not enough, all are picked.  Returns the blocks picked. */
+unsigned long par2_select(file_node** vols, int nvols, unsigned long deficit, char* pick) {
+    unsigned long long* cost;
+    long* from;
+    unsigned long b, to;
+    size_t row = deficit + 1;
+    unsigned long total = 0;
+    int i;
+
+    memset(pick, 0, nvols);
+    for(i = 0; i < nvols; i++) {
+        total += par2_volume_blocks(vols[i]->name);
+    }
+    if(!deficit) {
+        return 0;
+    }
+    if(total <= deficit) {
+        memset(pick, 1, nvols);
+        return total;
+    }
+
+    /* 0/1 knapsack over blocks, capped at the deficit: cost[b] is the
+     * fewest bytes that give b blocks (at least b, for the cap), and
+     * from[i][b] the state volume i was added to when it last improved b */
+    cost = (unsigned long long*)malloc(row * sizeof(unsigned long long));
+    from = (long*)malloc(nvols * row * sizeof(long));
+    if(!cost || !from) {
+        perror("malloc");
+        free(cost);
+        free(from);
+        memset(pick, 1, nvols);
+        return total;
+    }
+    cost[0] = 0;
+    for(b = 1; b <= deficit; b++) {
+        cost[b] = ~0ULL;
+    }
+    for(b = 0; b < nvols * row; b++) {
+        from[b] = -1;
+    }
+    for(i = 0; i < nvols; i++) {
+        int blocks = par2_volume_blocks(vols[i]->name);
+
+        for(b = deficit + 1; b-- > 0; ) {
+            if(cost[b] == ~0ULL || blocks <= 0) {
+                continue;
+            }
+            to = b + blocks < deficit ? b + blocks : deficit;
+            if(cost[b] + vols[i]->bytes < cost[to]) {
+                cost[to] = cost[b] + vols[i]->bytes;
+                from[i * row + to] = b;
+            }
+        }
+    }
+
+    /* walk back from the cap to recover the choice */
+    total = 0;
+    b = deficit;
+    for(i = nvols - 1; i >= 0 && b > 0; i--) {
+        if(from[i * row + b] >= 0) {
+            pick[i] = 1;
+            total += par2_volume_blocks(vols[i]->name);
+            b = from[i * row + b];
+        }
+    }
+    free(cost);
+    free(from);
+    return total;
+}
@@ -0,0 +1,171 @@
+/* Receive buffer pool.
+ *
+ * Buffers come in power-of-two size classes and are recycled instead of
+ * freed, so the steady state does no allocation.  An optional cap bounds
+ * the memory held by the pool, in use or idle; a reader that would exceed
+ * it first drops idle buffers and then waits for one to be released, which
+ * slows the connections down instead of letting memory grow.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nzbnews.h"
+
+#define POOL_MIN_SHIFT      16      /* 64kB */
+#define POOL_CLASSES        9       /* up to 16MB */
+
+typedef struct _pool_buf {
+    struct _pool_buf* next;
+    int cls;
+    int pad;
+} pool_buf;
+
+static struct _pool_t {
+    pthread_mutex_t lock;
+    pthread_cond_t  released;
+    pool_buf* free[POOL_CLASSES];
+    size_t cap;
+    size_t held;            /* bytes allocated, in use or idle */
+    size_t in_use;
+    size_t peak;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+void pool_init(size_t cap) {
+    pool.cap = cap;
+}
+
+size_t pool_class_size(int cls) {
+    return (size_t)1 << (POOL_MIN_SHIFT + cls);
+}
+
+static int pool_class(size_t size) {
+    int cls = 0;
+
+    while(cls < POOL_CLASSES - 1 && pool_class_size(cls) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+/* Release idle buffers until 'need' more bytes fit under the cap */
+static void pool_trim(size_t need) {
+    pool_buf* pb;
+    int cls;
+
+    for(cls = POOL_CLASSES - 1; cls >= 0 && pool.held + need > pool.cap; cls--) {
+        while(pool.free[cls] && pool.held + need > pool.cap) {
+            pb = pool.free[cls];
+            pool.free[cls] = pb->next;
+            pool.held -= pool_class_size(cls);
+            free(pb);
+        }
+    }
+}
+
+static char* pool_alloc(size_t size, size_t* len, int block) {
+    pool_buf* pb = NULL;
+    size_t csize;
+    int cls;
+    unsigned long long tspan = 0;
+
+    cls = pool_class(size);
+    csize = pool_class_size(cls);
+
+    pthread_mutex_lock(&pool.lock);
+    while(!(pb = pool.free[cls])) {
+        if(!pool.cap || pool.held + csize <= pool.cap) {
+            break;
+        }
+        pool_trim(csize);
+        if(pool.held + csize <= pool.cap || !pool.in_use || !block) {
+            break;
+        }
+        if(!tspan) {
+            tspan = trace_begin();
+        }
+        pthread_cond_wait(&pool.released, &pool.lock);
+    }
+    if(pb) {
+        pool.free[cls] = pb->next;
+    }
+    else {
+        pool.held += csize;
+    }
+    pool.in_use += csize;
+    if(pool.held > pool.peak) {
+        pool.peak = pool.held;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    trace_end("pool_wait", tspan, cls);
+
+    if(!pb && (pb = (pool_buf*)malloc(sizeof(pool_buf) + csize)) == NULL) {
+        perror("malloc");
+        pthread_mutex_lock(&pool.lock);
+        pool.held -= csize;
+        pool.in_use -= csize;
+        pthread_cond_broadcast(&pool.released);
+        pthread_mutex_unlock(&pool.lock);
+        return NULL;
+    }
+    pb->cls = cls;
+    *len = csize;
+    return (char*)(pb + 1);
+}
+
+/* Get a buffer of at least 'size' bytes, clamped to the largest class.
+ * The usable length is stored in *len. */
+char* pool_get(size_t size, size_t* len) {
+    return pool_alloc(size, len, 1);
+}
+
+void pool_put(char* buf) {
+    pool_buf* pb;
+
+    if(!buf) {
+        return;
+    }
+    pb = (pool_buf*)buf - 1;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.in_use -= pool_class_size(pb->cls);
+    pb->next = pool.free[pb->cls];
+    pool.free[pb->cls] = pb;
+    pthread_cond_broadcast(&pool.released);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Move the contents of buf into the next larger class.  Returns the new
+ * buffer, or NULL (leaving buf untouched) if it is already the largest.
+ * Growing never waits, since the caller already holds a buffer and every
+ * reader might be doing the same; the cap can be overshot by one buffer
+ * per connection. */
+char* pool_grow(char* buf, size_t used, size_t* len) {
+    char* bigger;
+
+    if(((pool_buf*)buf - 1)->cls >= POOL_CLASSES - 1) {
+        return NULL;
+    }
+    if((bigger = pool_alloc(*len * 2, len, 0)) == NULL) {
+        return NULL;
+    }
+    memcpy(bigger, buf, used);
+    pool_put(buf);
+    return bigger;
+}
+
+void pool_cleanup(void) {
+    pool_buf* pb;
+    int cls;
+
+    pthread_mutex_lock(&pool.lock);
+    for(cls = 0; cls < POOL_CLASSES; cls++) {
+        while((pb = pool.free[cls]) != NULL) {
+            pool.free[cls] = pb->next;
+            pool.held -= pool_class_size(cls);
+            free(pb);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    DEBUG("%s: peak buffer memory %.2f MB\n", __FUNCTION__, pool.peak / (1024.0 * 1024.0));
+}
@@ -0,0 +1,170 @@
+/* Post-processing pipeline.
+ *
+ * Connection threads hand finished files to a small pool of workers that
+ * check segment CRCs, decode and write the .done marker, so the sockets can
+ * move straight on to the next file.  The queue is bounded: when it is full
+ * postproc_submit() blocks, which holds back the downloaders and keeps the
+ * undecoded segment files on disk to a fixed number of files.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "nzbnews.h"
+
+static struct _postproc_t {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    file_node** queue;
+    int depth;
+    int head;
+    int count;
+    int closed;
+    int nworkers;
+    pthread_t* workers;
+} pp = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Checks the yEnc pcrc32 of every downloaded segment.  Segments that fail
+ * are marked not done.  Returns the number of damaged segments. */
+int postproc_verify(file_node* file) {
+    segment_node* segment;
+    char filename[1024];
+    char* buf = NULL;
+    unsigned char* out = NULL;
+    size_t buflen = 0;
+    struct stat finfo;
+    yenc_info info;
+    FILE* fp;
+    unsigned long long slice = 0;
+    int damaged = 0;
+    int len;
+
+    for(segment = file->segments; segment; segment = segment->next) {
+        if(!segment->done) {
+            continue;
+        }
+        snprintf(filename, sizeof(filename), "%s/.%s.%u", g.outdir, file->filename, segment->number);
+        if(stat(filename, &finfo) != 0 || (fp = fopen(filename, "r")) == NULL) {
+            continue;
+        }
+        if(finfo.st_size + 1 > buflen) {
+            buflen = finfo.st_size + 1;
+            free(buf);
+            free(out);
+            buf = malloc(buflen);
+            out = malloc(buflen);
+            if(!buf || !out) {
+                perror("malloc");
+                fclose(fp);
+                break;
+            }
+        }
+        if(fread(buf, 1, finfo.st_size, fp) == finfo.st_size
+        && (len = yenc_decode(buf, finfo.st_size, out, buflen, &info)) >= 0) {
+            if(info.has_pcrc32 && info.pcrc32 != info.crc32) {
+                fprintf(stderr, "%s: crc mismatch in segment %u of [%s] (%08lx != %08lx)\n",
+                    __FUNCTION__, segment->number, file->name, info.crc32, info.pcrc32);
+                segment->done = 0;
+                damaged++;
+            }
+            else if(file->type == FILE_PAR2_INDEX && !slice) {
+                slice = par2_scan(out, len);
+            }
+        }
+        fclose(fp);
+    }
+    free(buf);
+    free(out);
+    if(slice) {
+        sched_par2_slice(file, slice);
+    }
+    return damaged;
+}
+
+static void* postproc_thread(void* arg) {
+    file_node* file;
+
+    trace_thread_name("postproc");
+    for(;;) {
+        pthread_mutex_lock(&pp.lock);
+        while(!pp.count && !pp.closed) {
+            pthread_cond_wait(&pp.not_empty, &pp.lock);
+        }
+        if(!pp.count) {
+            pthread_mutex_unlock(&pp.lock);
+            break;
+        }
+        file = pp.queue[pp.head];
+        pp.head = (pp.head + 1) % pp.depth;
+        pp.count--;
+        pthread_cond_signal(&pp.not_full);
+        pthread_mutex_unlock(&pp.lock);
+
+        if(g.running) {
+            postproc_verify(file);
+            finish_file(file);
+            sched_file_done(file);
+        }
+    }
+    return NULL;
+}
+
+int postproc_init(int workers, int depth) {
+    int i;
+
+    pp.nworkers = workers > 0 ? workers : 1;
+    pp.depth = depth > 0 ? depth : 1;
+    pp.head = 0;
+    pp.count = 0;
+    pp.closed = 0;
+
+    if((pp.queue = (file_node**)calloc(pp.depth, sizeof(file_node*))) == NULL
+    || (pp.workers = (pthread_t*)calloc(pp.nworkers, sizeof(pthread_t))) == NULL) {
+        perror("calloc");
+        return NN_ERROR;
+    }
+    for(i = 0; i < pp.nworkers; i++) {
+        if(pthread_create(&pp.workers[i], NULL, postproc_thread, NULL) != 0) {
+            perror("pthread_create");
+            return NN_ERROR;
+        }
+    }
+    return NN_OK;
+}
+
+/* Queue a file whose segments are all resolved.  Blocks while the queue
+ * is full. */
+int postproc_submit(file_node* file) {
+    pthread_mutex_lock(&pp.lock);
+    while(pp.count == pp.depth && !pp.closed) {
+        pthread_cond_wait(&pp.not_full, &pp.lock);
+    }
+    if(pp.closed) {
+        pthread_mutex_unlock(&pp.lock);
+        return NN_ERROR;
+    }
+    pp.queue[(pp.head + pp.count) % pp.depth] = file;
+    pp.count++;
+    pthread_cond_signal(&pp.not_empty);
+    pthread_mutex_unlock(&pp.lock);
+    return NN_OK;
+}
+
+/* Drain the queue and stop the workers */
+void postproc_finish(void) {
+    int i;
+
+    pthread_mutex_lock(&pp.lock);
+    pp.closed = 1;
+    pthread_cond_broadcast(&pp.not_empty);
+    pthread_cond_broadcast(&pp.not_full);
+    pthread_mutex_unlock(&pp.lock);
+
+    for(i = 0; i < pp.nworkers; i++) {
+        pthread_join(pp.workers[i], NULL);
+    }
+    free(pp.workers); pp.workers = NULL;
+    free(pp.queue); pp.queue = NULL;
+}
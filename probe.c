@@ -0,0 +1,121 @@
+/* First-segment probe.
+ *
+ * With -y the scheduler hands out one segment of every file before
+ * anything else (see sched.c), and the first of them to arrive is read
+ * for its =ybegin and =ypart lines.  That gives the file's real name and
+ * decoded size, and the ratio of the article size to the data it carries,
+ * from which the scheduler corrects the NZB's byte estimates.  The probe
+ * segment is kept for the decode, so the pass costs nothing extra.
+ *
+ * The output file is then reserved at its full size with fallocate()
+ * without changing its length, so the space is found (or found missing)
+ * before the download and the data lands in one contiguous extent.  At
+ * decode time the temporary file from uudeview is copied into the
+ * reserved file instead of replacing it.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nzbnews.h"
+
+/* Reserve size bytes for outdir/name.  Names that would land outside the
+ * output directory or hide in it are left alone. */
+static void probe_reserve(char* name, unsigned long long size) {
+    char path[1024];
+    int fd;
+
+    if(!*name || *name == '.' || strchr(name, '/')) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%s", g.outdir, name);
+    if((fd = open(path, O_WRONLY | O_CREAT, 0644)) == -1) {
+        perror("open");
+        return;
+    }
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) != 0) {
+        if(errno == ENOSPC) {
+            fprintf(stderr, "%s: no space for %llu bytes of [%s]\n", __FUNCTION__, size, name);
+        }
+        else if(errno != EOPNOTSUPP) {
+            perror("fallocate");
+        }
+    }
+    close(fd);
+}
+
+/* Read the yEnc headers of a downloaded segment and pass what they say
+ * about its file on to the scheduler */
+void probe_segment(segment_node* segment) {
+    file_node* file = segment->file;
+    char filename[1024];
+    struct stat finfo;
+    yenc_info info;
+    char* buf;
+    unsigned char* out;
+    unsigned long part;
+    FILE* fp;
+    int len = NN_ERROR;
+
+    snprintf(filename, sizeof(filename), "%s/.%s.%u", g.outdir, file->filename, segment->number);
+    if(stat(filename, &finfo) != 0 || (fp = fopen(filename, "r")) == NULL) {
+        return;
+    }
+    buf = malloc(finfo.st_size + 1);
+    out = malloc(finfo.st_size + 1);
+    if(!buf || !out) {
+        perror("malloc");
+        exit(1);
+    }
+    if(fread(buf, 1, finfo.st_size, fp) == finfo.st_size) {
+        len = yenc_decode(buf, finfo.st_size, out, finfo.st_size + 1, &info);
+    }
+    fclose(fp);
+    free(buf);
+    free(out);
+
+    if(len <= 0 || !info.size) {
+        DEBUG("%s: no yEnc header in segment %u of [%s]\n", __FUNCTION__, segment->number, file->name);
+        return;
+    }
+    part = info.end >= info.begin && info.begin ? info.end - info.begin + 1 : len;
+    if(sched_probed(file, info.name, info.size, part, finfo.st_size)) {
+        probe_reserve(file->name, info.size);
+    }
+}
+
+/* Copy a decoded temporary file into the file reserved for it, keeping
+ * the reserved blocks, and trim it to the decoded length */
+int probe_fill(char* src, char* dst) {
+    char buf[65536];
+    int in, out;
+    ssize_t n;
+    off_t len = 0;
+    int ret = NN_OK;
+
+    if((in = open(src, O_RDONLY)) == -1) {
+        return NN_ERROR;
+    }
+    if((out = open(dst, O_WRONLY | O_CREAT, 0644)) == -1) {
+        close(in);
+        return NN_ERROR;
+    }
+    while((n = read(in, buf, sizeof(buf))) > 0) {
+        if(write(out, buf, n) != n) {
+            ret = NN_ERROR;
+            break;
+        }
+        len += n;
+    }
+    if(n < 0 || ftruncate(out, len) != 0) {
+        ret = NN_ERROR;
+    }
+    close(in);
+    close(out);
+    return ret;
+}
@@ -0,0 +1,219 @@
+/* Progress reporting.
+ *
+ * The receive path only bumps counters (g.stats, server->bytes and
+ * conn->bytes); a reporter thread samples them a few times a second and
+ * does all of the terminal output.  On a terminal it redraws one status
+ * line on stderr with the total and per-connection rates, the ETA and the
+ * number of queued segments.  Otherwise, or with -q, it writes a
+ * key=value line every few seconds that is easy to parse:
+ *
+ *  progress elapsed=12 done=... total=... segments=.../... rate=... eta=... queue=... conn0=...
+ *
+ * done and total are in bytes, rates in bytes per second.
+ *
+ * Connection threads that have something to say about a segment go
+ * through progress_message(), which clears the status line first and
+ * redraws it after, so the two do not run together.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "nzbnews.h"
+
+#define PROGRESS_HZ         4
+#define PROGRESS_EVERY      20      /* samples between lines in quiet mode */
+#define PROGRESS_SMOOTH     0.25    /* weight of the newest sample in the rates */
+#define PROGRESS_WIDTH      160
+
+static struct _progress_t {
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+    pthread_t thread;
+    short running;
+    short mode;
+    unsigned long long last;        /* trace_now() of the previous sample */
+    unsigned long last_bytes;
+    double rate;
+    char line[PROGRESS_WIDTH + 32]; /* the status line on the terminal */
+} p = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+int progress_mode(char* name) {
+    if(!strcasecmp(name, "auto")) {
+        return PROGRESS_AUTO;
+    }
+    else if(!strcasecmp(name, "off")) {
+        return PROGRESS_OFF;
+    }
+    else if(!strcasecmp(name, "tty")) {
+        return PROGRESS_TTY;
+    }
+    else if(!strcasecmp(name, "quiet")) {
+        return PROGRESS_QUIET;
+    }
+    return NN_ERROR;
+}
+
+static double smooth(double old, double sample) {
+    return old ? old + PROGRESS_SMOOTH * (sample - old) : sample;
+}
+
+/* Format seconds as h:mm:ss, or "-" when unknown */
+static char* progress_eta(char* buf, size_t len, double secs) {
+    unsigned long s;
+
+    if(secs < 0 || secs > 99 * 3600) {
+        snprintf(buf, len, "-");
+        return buf;
+    }
+    s = (unsigned long)secs;
+    snprintf(buf, len, "%lu:%02lu:%02lu", s / 3600, (s / 60) % 60, s % 60);
+    return buf;
+}
+
+static void progress_sample(unsigned long n) {
+    server_node* server;
+    connection* conn;
+    unsigned long long now = trace_now();
+    unsigned long bytes = __atomic_load_n(&g.stats.bytes, __ATOMIC_RELAXED);
+    unsigned long done = __atomic_load_n(&g.stats.done_bytes, __ATOMIC_RELAXED);
+    unsigned long total = g.stats.total_bytes;
+    unsigned long delta;
+    double dt = (now - p.last) / 1e9;
+    double eta = -1;
+    char* line = p.line;
+    char etabuf[32];
+    int len;
+    int i;
+
+    if(dt <= 0) {
+        return;
+    }
+    p.rate = smooth(p.rate, (bytes - p.last_bytes) / dt);
+    g.stats.rate = p.rate;
+    for(server = g.servers; server; server = server->next) {
+        for(i = 0; server->conns && i < server->max; i++) {
+            conn = &server->conns[i];
+            delta = __atomic_load_n(&conn->bytes, __ATOMIC_RELAXED) - conn->last_bytes;
+            conn->last_bytes += delta;
+            conn->rate = smooth(conn->rate, delta / dt);
+        }
+    }
+    p.last = now;
+    p.last_bytes = bytes;
+
+    if(p.rate > 0 && total >= done) {
+        eta = (total - done) / p.rate;
+    }
+    progress_eta(etabuf, sizeof(etabuf), eta);
+
+    if(p.mode == PROGRESS_QUIET) {
+        if(n % PROGRESS_EVERY) {
+            return;
+        }
+        fprintf(stderr, "progress elapsed=%lu done=%lu total=%lu segments=%lu/%lu "
+                        "rate=%.0f eta=%s queue=%d",
+            (unsigned long)(time(NULL) - g.stats.start), done, total,
+            __atomic_load_n(&g.stats.done_segments, __ATOMIC_RELAXED), g.stats.total_segments,
+            p.rate, etabuf, __atomic_load_n(&g.stats.queued, __ATOMIC_RELAXED));
+        for(server = g.servers; server; server = server->next) {
+            for(i = 0; server->conns && i < server->max; i++) {
+                fprintf(stderr, " conn%d=%.0f", server->conns[i].id, server->conns[i].rate);
+            }
+        }
+        fprintf(stderr, "\n");
+        return;
+    }
+
+    len = snprintf(line, sizeof(p.line), "%5.1f%% %8.2f kB/s ETA %s queue %d |",
+        total ? done * 100.0 / total : 0.0, p.rate / 1000, etabuf,
+        __atomic_load_n(&g.stats.queued, __ATOMIC_RELAXED));
+    for(server = g.servers; server && len < PROGRESS_WIDTH; server = server->next) {
+        for(i = 0; server->conns && i < server->max && len < PROGRESS_WIDTH; i++) {
+            conn = &server->conns[i];
+            len += snprintf(line + len, sizeof(p.line) - len, " %d:%.0f", conn->id, conn->rate / 1000);
+        }
+    }
+    if(len > PROGRESS_WIDTH) {
+        strcpy(line + PROGRESS_WIDTH - 3, "...");
+    }
+    fprintf(stderr, "\r%s\033[K", line);
+}
+
+static void* progress_thread(void* arg) {
+    struct timeval now;
+    struct timespec until;
+    unsigned long n = 0;
+
+    pthread_mutex_lock(&p.lock);
+    while(p.running) {
+        gettimeofday(&now, NULL);
+        until.tv_sec = now.tv_sec;
+        until.tv_nsec = now.tv_usec * 1000 + 1000000000 / PROGRESS_HZ;
+        if(until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&p.stop, &p.lock, &until);
+        if(p.running) {
+            progress_sample(++n);
+        }
+    }
+    pthread_mutex_unlock(&p.lock);
+    return NULL;
+}
+
+/* Print a message to fp without mangling the status line */
+void progress_message(FILE* fp, char* fmt, ...) {
+    va_list ap;
+    int tty;
+
+    pthread_mutex_lock(&p.lock);
+    tty = p.running && p.mode == PROGRESS_TTY && p.line[0];
+    if(tty) {
+        fprintf(stderr, "\r\033[K");
+    }
+    va_start(ap, fmt);
+    vfprintf(fp, fmt, ap);
+    va_end(ap);
+    fflush(fp);
+    if(tty) {
+        fprintf(stderr, "\r%s\033[K", p.line);
+    }
+    pthread_mutex_unlock(&p.lock);
+}
+
+void progress_start(int mode) {
+    if(mode == PROGRESS_AUTO) {
+        mode = isatty(STDERR_FILENO) ? PROGRESS_TTY : PROGRESS_QUIET;
+    }
+    if(mode == PROGRESS_OFF) {
+        return;
+    }
+    p.mode = mode;
+    p.last = trace_now();
+    p.last_bytes = g.stats.bytes;
+    p.line[0] = '\0';
+    p.running = 1;
+    if(pthread_create(&p.thread, NULL, progress_thread, NULL) != 0) {
+        perror("pthread_create");
+        p.running = 0;
+    }
+}
+
+void progress_stop(void) {
+    if(!p.running) {
+        return;
+    }
+    pthread_mutex_lock(&p.lock);
+    p.running = 0;
+    pthread_cond_broadcast(&p.stop);
+    pthread_mutex_unlock(&p.lock);
+    pthread_join(p.thread, NULL);
+    if(p.mode == PROGRESS_TTY) {
+        fprintf(stderr, "\n");
+    }
+}
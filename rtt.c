@@ -0,0 +1,160 @@
+/* Adaptive socket timeouts.
+ *
+ * send_msg() and recv_msg() wait no longer than the deadline computed here
+ * for each connection, in the manner of the TCP retransmission timer
+ * (RFC 6298).  The time from sending a command to the first byte of the
+ * reply is an RTT sample, smoothed into srtt and rttvar; the wait for the
+ * first byte of a reply is srtt + 4 * rttvar.  The sample includes the
+ * time the server takes to look up an article, which varies a lot more
+ * than the network does, hence the generous floor.  While a reply is
+ * coming in, the gaps between arrivals are smoothed the same way, so the
+ * inactivity deadline follows the throughput the link actually delivers:
+ * it is the larger of the first-byte deadline and sgap + 4 * sgapvar.
+ * Both are clamped to RTT_MIN_MS..RTT_MAX_MS and double with each timeout
+ * in a row, which get_segment() turns into a few increasingly patient
+ * waits for the BODY response and its text before giving up on the
+ * connection.
+ *
+ * A first byte that arrives after a timeout is not sampled (Karn's rule).
+ * A new connection starts from the estimate pooled over all connections,
+ * which its greeting then refines; before any sample the deadline is
+ * RTT_INITIAL_MS.  timeout= in the configuration fixes the deadlines
+ * instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+
+#include "nzbnews.h"
+
+#define RTT_INITIAL_MS      10000.0     /* before the first sample */
+#define RTT_MIN_MS          3000.0
+#define RTT_MAX_MS          30000.0
+#define RTT_BACKOFF_MAX     3           /* doublings after timeouts in a row */
+
+typedef struct _rtt_state {
+    short waiting;              /* a command is out and nothing has come back */
+    short backoff;              /* timeouts since the last data */
+    unsigned long long sent;    /* trace_now() when the command went out */
+    unsigned long long last;    /* trace_now() of the last data */
+    double srtt;                /* ms, 0 before the first sample */
+    double rttvar;
+    double sgap;
+    double sgapvar;
+} rtt_state;
+
+static struct _rtt_t {
+    pthread_mutex_t lock;
+    double srtt;                /* pooled over all connections */
+    double rttvar;
+    rtt_state socks[FD_SETSIZE];
+} rtt = { PTHREAD_MUTEX_INITIALIZER };
+
+static void smooth(double* srtt, double* rttvar, double sample) {
+    if(*srtt == 0) {
+        *srtt = sample;
+        *rttvar = sample / 2;
+    }
+    else {
+        *rttvar = 0.75 * *rttvar + 0.25 * (*srtt > sample ? *srtt - sample : sample - *srtt);
+        *srtt = 0.875 * *srtt + 0.125 * sample;
+    }
+}
+
+static double clamp(double ms) {
+    return ms < RTT_MIN_MS ? RTT_MIN_MS : ms > RTT_MAX_MS ? RTT_MAX_MS : ms;
+}
+
+/* A connection was opened on sock; its greeting is the first reply */
+void rtt_open(int sock) {
+    rtt_state* r;
+
+    if(sock < 0 || sock >= FD_SETSIZE) {
+        return;
+    }
+    r = &rtt.socks[sock];
+    memset(r, 0, sizeof(rtt_state));
+    pthread_mutex_lock(&rtt.lock);
+    r->srtt = rtt.srtt;
+    r->rttvar = rtt.rttvar;
+    pthread_mutex_unlock(&rtt.lock);
+    r->waiting = 1;
+    r->sent = r->last = trace_now();
+}
+
+/* A command was sent on sock */
+void rtt_sent(int sock) {
+    rtt_state* r;
+
+    if(sock < 0 || sock >= FD_SETSIZE) {
+        return;
+    }
+    r = &rtt.socks[sock];
+    if(!r->waiting) {
+        r->waiting = 1;
+        r->backoff = 0;
+        r->sent = trace_now();
+    }
+}
+
+/* recv() on sock returned rc: bytes, 0 for a close, or an NN_ code */
+void rtt_received(int sock, int rc) {
+    rtt_state* r;
+    unsigned long long now;
+    double ms;
+
+    if(sock < 0 || sock >= FD_SETSIZE) {
+        return;
+    }
+    r = &rtt.socks[sock];
+    if(rc == NN_TIMEOUT) {
+        if(r->backoff < RTT_BACKOFF_MAX) {
+            r->backoff++;
+        }
+        return;
+    }
+    if(rc <= 0) {
+        return;
+    }
+    now = trace_now();
+    if(r->waiting) {
+        if(!r->backoff) {
+            ms = (now - r->sent) / 1e6;
+            smooth(&r->srtt, &r->rttvar, ms);
+            pthread_mutex_lock(&rtt.lock);
+            smooth(&rtt.srtt, &rtt.rttvar, ms);
+            pthread_mutex_unlock(&rtt.lock);
+            DEBUG3("%s: [%d] rtt %.1f ms, srtt %.1f rttvar %.1f\n", __FUNCTION__,
+                sock, ms, r->srtt, r->rttvar);
+        }
+        r->waiting = 0;
+    }
+    else {
+        smooth(&r->sgap, &r->sgapvar, (now - r->last) / 1e6);
+    }
+    r->backoff = 0;
+    r->last = now;
+}
+
+/* How long to wait on sock now, in ms.  timeout, in seconds, overrides it
+ * when not 0. */
+long rtt_timeout(int sock, int timeout) {
+    rtt_state* r;
+    double rto;
+    double gap;
+
+    if(timeout > 0 || g.timeout > 0) {
+        return (timeout > 0 ? timeout : g.timeout) * 1000L;
+    }
+    if(sock < 0 || sock >= FD_SETSIZE) {
+        return (long)RTT_INITIAL_MS;
+    }
+    r = &rtt.socks[sock];
+    rto = r->srtt ? clamp(r->srtt + 4 * r->rttvar) : RTT_INITIAL_MS;
+    if(!r->waiting && r->sgap) {
+        gap = clamp(r->sgap + 4 * r->sgapvar);
+        rto = gap > rto ? gap : rto;
+    }
+    return (long)rto << r->backoff;
+}
@@ -0,0 +1,195 @@
+/* Sampling verify.
+ *
+ * With -V n only n segments of each file are checked with STAT: the first,
+ * the last, and one picked at random from each of n - 2 equal stretches in
+ * between, so damage anywhere in a file has a fair chance of showing; n is
+ * at least 3, so there is always a stretch.  Every sample stands for its
+ * stretch: the missing segments of the job are estimated as the sum of the
+ * sizes of the stretches whose sample was missing, the ends counting for
+ * one segment each.  The confidence bound is the Wilson score interval at
+ * 95% around that fraction, taken over all the segments checked.  Only a
+ * 430 counts as missing: a lost connection is reopened and the sample
+ * asked again, and if that fails there is no verdict.
+ *
+ * With the files classified as data, par2 index and recovery volumes, the
+ * expected damage to the data files is turned into par2 blocks the way
+ * par2.c does, with the slice size estimated from the volumes (bytes per
+ * recovery block), and compared with the blocks the volumes should still
+ * carry given their own sampled completeness.  The verdict uses the
+ * pessimistic end of the bounds, and nzbnews exits with 2 when a data
+ * segment is missing and the recovery volumes are not expected to be
+ * enough, or with 1 when the server could not be asked.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nzbnews.h"
+
+#define SAMPLE_Z            1.96    /* 95% confidence */
+
+typedef struct _sample_stat {
+    unsigned long segments;     /* in the files */
+    unsigned long checked;
+    unsigned long missing;
+    double est_missing;         /* segments, by stretch size */
+    unsigned long long bytes;
+} sample_stat;
+
+/* Upper end of the Wilson score interval for a fraction p seen in n */
+static double wilson_upper(double p, unsigned long n) {
+    double z2 = SAMPLE_Z * SAMPLE_Z;
+    double center, half;
+
+    if(!n) {
+        return 1;
+    }
+    center = (p + z2 / (2 * n)) / (1 + z2 / n);
+    half = SAMPLE_Z * sqrt(p * (1 - p) / n + z2 / (4.0 * n * n)) / (1 + z2 / n);
+    return center + half < 1 ? center + half : 1;
+}
+
+/* STAT a stratified sample of the file's segments into st.  Returns
+ * NN_ERROR if the connection was lost and could not be reopened. */
+static int sample_file(int* sock, file_node* file, int samples, unsigned int* seed, sample_stat* st) {
+    segment_node** segs;
+    segment_node* segment;
+    unsigned long bytes = 0;
+    int count = 0;
+    int missing = 0;
+    int checked = 0;
+    double est = 0;
+    int lo, hi;
+    int rc;
+    int i, k;
+
+    for(segment = file->segments; segment; segment = segment->next) {
+        count++;
+        bytes += segment->bytes;
+    }
+    if(!count) {
+        return NN_OK;
+    }
+    if((segs = (segment_node**)calloc(count, sizeof(segment_node*))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for(segment = file->segments, i = 0; segment; segment = segment->next) {
+        segs[i++] = segment;
+    }
+
+    for(k = 0; k < samples && k < count && g.running; k++) {
+        lo = hi = 0;
+        if(samples >= count) {
+            i = k;
+        }
+        else if(k == 0) {
+            i = 0;
+        }
+        else if(k == 1) {
+            i = count - 1;
+        }
+        else {
+            /* stretch k - 2 of the samples - 2 between the ends */
+            lo = 1 + (long)(count - 2) * (k - 2) / (samples - 2);
+            hi = 1 + (long)(count - 2) * (k - 1) / (samples - 2);
+            if(hi <= lo) {
+                continue;
+            }
+            i = lo + rand_r(seed) % (hi - lo);
+        }
+        if((rc = stat_msg(sock, segs[i]->msgid)) < 0) {
+            fprintf(stderr, "%s: connection lost, reconnecting\n", __FUNCTION__);
+            server_disconnect(sock);
+            if((*sock = server_connect(g.servers, 3)) == -1
+            || (rc = stat_msg(sock, segs[i]->msgid)) < 0) {
+                free(segs);
+                return NN_ERROR;
+            }
+        }
+        checked++;
+        if(rc == 1) {
+            missing++;
+            est += hi > lo ? hi - lo : 1;
+            DEBUG("%s: no such article [%s]\n", __FUNCTION__, segs[i]->msgid);
+        }
+        __sync_fetch_and_add(&g.stats.done_segments, 1);
+        __sync_fetch_and_add(&g.stats.done_bytes, segs[i]->bytes);
+    }
+    free(segs);
+
+    printf("%s: %d/%d sampled segments available of %d [%s]\n", __FUNCTION__,
+        checked - missing, checked, count, file->name);
+    st->segments += count;
+    st->checked += checked;
+    st->missing += missing;
+    st->bytes += bytes;
+    st->est_missing += est;
+    return NN_OK;
+}
+
+/* Sample every file of the lists and report.  Returns 0 if the job looks
+ * complete or repairable, 2 if not and 1 if the sampling failed. */
+int sample_verify(int* sock, file_node** lists, int nlists, int samples) {
+    sample_stat data = { 0 };
+    sample_stat vols = { 0 };
+    sample_stat other = { 0 };
+    sample_stat all;
+    file_node* file;
+    unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    unsigned long vol_blocks = 0;
+    double frac, upper, slice, need, have;
+    int i;
+
+    for(i = 0; i < nlists; i++) {
+        for(file = lists[i]; file && g.running; file = file->next) {
+            sched_classify(file);
+            if(sample_file(sock, file, samples, &seed,
+                file->type == FILE_DATA ? &data : file->type == FILE_PAR2_VOL ? &vols : &other) < 0) {
+                fprintf(stderr, "%s: cannot reach the server, no verdict\n", __FUNCTION__);
+                return 1;
+            }
+            if(file->type == FILE_PAR2_VOL) {
+                vol_blocks += par2_volume_blocks(file->name);
+            }
+        }
+    }
+
+    all.segments = data.segments + vols.segments + other.segments;
+    all.checked = data.checked + vols.checked + other.checked;
+    all.est_missing = data.est_missing + vols.est_missing + other.est_missing;
+    if(!all.segments) {
+        return 0;
+    }
+    frac = all.est_missing / all.segments;
+    upper = all.checked == all.segments ? frac : wilson_upper(frac, all.checked);
+    printf("%s: %lu of %lu segments checked, estimated completeness %.2f%% (at least %.2f%% at 95%%)\n",
+        __FUNCTION__, all.checked, all.segments, 100 * (1 - frac), 100 * (1 - upper));
+
+    if(!data.missing) {
+        return 0;
+    }
+    if(!vol_blocks || !vols.bytes) {
+        printf("%s: no recovery volumes to cover the damage\n", __FUNCTION__);
+        return 2;
+    }
+
+    /* as par2_damaged_blocks(), with every missing segment its own run */
+    slice = (double)vols.bytes / vol_blocks;
+    upper = data.checked == data.segments ? data.est_missing / data.segments
+        : wilson_upper(data.est_missing / data.segments, data.checked);
+    need = upper * data.bytes / slice + upper * data.segments;
+    frac = vols.segments ? vols.est_missing / vols.segments : 0;
+    have = vol_blocks * (1 - (vols.checked == vols.segments ? frac : wilson_upper(frac, vols.checked)));
+    printf("%s: expect up to %.0f damaged blocks of %.0f bytes, recovery volumes carry about %.0f of %lu\n",
+        __FUNCTION__, ceil(need), slice, floor(have), vol_blocks);
+    if(need > have) {
+        printf("%s: recovery volumes may not cover the damage\n", __FUNCTION__);
+        return 2;
+    }
+    printf("%s: recovery volumes can cover the damage\n", __FUNCTION__);
+    return 0;
+}
@@ -0,0 +1,932 @@
+/* Download scheduler.
+ *
+ * Orders the parsed file list according to a policy and hands out single
+ * segments to the connection threads, so every connection stays busy until
+ * the tail of the job.  Files are finished in dispatch order, which keeps
+ * the small par2 index at the front and the recovery volumes at the back.
+ *
+ * Once everything has been handed out, idle connections may be given a
+ * duplicate of a straggling segment (a hedged request).  The first attempt
+ * to complete claims the segment with sched_claim(); the others drop their
+ * copy.
+ *
+ * A failed segment is not given up on straight away but put on a retry
+ * queue.  Network errors and timeouts are retried at once by whichever
+ * connection asks next, then with exponential backoff; a 430 moves the
+ * segment on to a server that has not been asked yet.  Backup servers only
+ * take segments from the retry queue while the primary server has
+ * connections left, and everything once it has none.  Queued retries never
+ * hold up new segments, and a file is only passed on once all of its
+ * segments are resolved.
+ *
+ * With -R the recovery volumes are held back until every other file has
+ * been post-processed, and only as many are released as the damage needs
+ * (see par2.c).
+ *
+ * With -O one file is streamed in order (see stream.c): no segment is
+ * dispatched past the read-ahead window, and retries and hedges favour the
+ * lowest segment number, which is the one holding up the writer.
+ *
+ * With -y the first segment of every file is handed out before any other
+ * (a probe pass, see probe.c), and sched_probed() corrects the file's
+ * byte estimates from the yEnc headers of whichever arrives first.
+ *
+ * Several NZBs can be given at once; each is a job with its own file
+ * order, and the jobs share the connections by weighted fair queuing at
+ * segment granularity.  Every job has a virtual time that advances by the
+ * bytes it is handed divided by its weight, and the next segment comes
+ * from the job with the highest priority and then the lowest virtual time.
+ * A job that comes back from a pause or into a new priority class starts
+ * at the current virtual time, so it gets its share from then on but no
+ * credit for the time it was out.  A higher priority preempts lower ones
+ * at the next segment; in-flight segments finish.  Priority, weight and
+ * pausing are read from the -K control file, which is checked for changes
+ * about once a second, one line per job:
+ *
+ *  urgent.nzb priority=1
+ *  big.nzb weight=0.5 paused=1
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "nzbnews.h"
+
+#define HEDGE_SAMPLES       256         /* transfer times kept for the percentile */
+#define HEDGE_MIN_SAMPLES   8
+#define HEDGE_MIN_NS        500000000ULL
+#define HEDGE_PERCENTILE    90
+#define RETRY_MAX           5           /* transient failures before giving up */
+#define RETRY_BASE_NS       1000000000ULL
+#define RETRY_MAX_NS        30000000000ULL
+#define MAX_SERVERS         32          /* servers tracked in segment->tried */
+#define CONTROL_CHECK_NS    1000000000ULL
+
+typedef struct _sched_job {
+    char name[256];
+    file_node** files;      /* files in dispatch order */
+    int nfiles;
+    int cur;                /* first file with undispatched segments */
+    int rr;                 /* round-robin position for SCHED_INTERLEAVE */
+    int probed;             /* files given their probe segment, for -y */
+    file_node** held;       /* recovery volumes waiting for the damage count */
+    int nheld;
+    unsigned long long slice;   /* par2 block size from the index, 0 if unknown */
+    int unfinished;         /* other files not yet post-processed */
+    int remaining;          /* queued files not yet complete */
+    int priority;
+    double weight;
+    short paused;
+    double vtime;           /* bytes handed out / weight */
+    time_t start;
+} sched_job;
+
+static struct _sched_t {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int policy;
+    sched_job* jobs;
+    int njobs;
+    double vclock;          /* virtual time of the last dispatch */
+    struct timespec control_mtime;
+    unsigned long long control_checked;
+    segment_node** inflight;
+    int ninflight;
+    int maxinflight;
+    double samples[HEDGE_SAMPLES];  /* ns per byte of recent transfers */
+    unsigned long nsamples;
+    unsigned long hedges;
+    segment_node* retries;  /* failed segments waiting for another attempt */
+    int nretries;
+    unsigned int servers;   /* bit per server with connections left */
+    int conns[MAX_SERVERS];
+    unsigned long requeued;
+    unsigned long failed;
+} s = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+int sched_policy(char* name) {
+    if(!strcasecmp(name, "order")) {
+        return SCHED_ORDER;
+    }
+    else if(!strcasecmp(name, "par2")) {
+        return SCHED_PAR2;
+    }
+    else if(!strcasecmp(name, "smallest")) {
+        return SCHED_SMALLEST;
+    }
+    else if(!strcasecmp(name, "interleave")) {
+        return SCHED_INTERLEAVE;
+    }
+    return NN_ERROR;
+}
+
+static int ends_with(char* str, char* suffix) {
+    size_t len = strlen(str);
+    size_t slen = strlen(suffix);
+
+    return len >= slen && !strcasecmp(str + len - slen, suffix);
+}
+
+/* Pull the real filename out of the subject and classify the file by its
+ * extension.  Most posters quote the name, e.g. "foo.vol03+04.par2" yEnc (1/2) */
+void sched_classify(file_node* file) {
+    char* p;
+    char* q;
+    char* vol;
+
+    if((p = strchr(file->subject, '"')) != NULL
+    && (q = strchr(p + 1, '"')) != NULL
+    && q - p - 1 < sizeof(file->name)) {
+        memcpy(file->name, p + 1, q - p - 1);
+        file->name[q - p - 1] = '\0';
+    }
+    else {
+        snprintf(file->name, sizeof(file->name), "%s", file->subject);
+    }
+
+    file->type = FILE_DATA;
+    if(ends_with(file->name, ".par2")) {
+        file->type = FILE_PAR2_INDEX;
+        if((vol = strrchr(file->name, '.')) != NULL) {
+            /* name.volNN+MM.par2 */
+            while(vol > file->name && *(vol - 1) != '.') {
+                vol--;
+            }
+            if(!strncasecmp(vol, "vol", 3) && isdigit(vol[3])) {
+                file->type = FILE_PAR2_VOL;
+            }
+        }
+    }
+}
+
+/* Link segments that repeat an msgid to the first one in dispatch order.
+ * Only the first is fetched; the connection that gets it resolves the rest. */
+static void sched_find_dups(sched_job* job, int nsegments) {
+    segment_node** table;
+    segment_node* segment;
+    unsigned long size = 1;
+    unsigned long h;
+    int i;
+
+    while(size < (unsigned long)nsegments * 2) {
+        size <<= 1;
+    }
+    if((table = (segment_node**)calloc(size, sizeof(segment_node*))) == NULL) {
+        return;
+    }
+    for(i = 0; i < job->nfiles; i++) {
+        for(segment = job->files[i]->segments; segment; segment = segment->next) {
+            for(h = cache_hash(segment->msgid) & (size - 1); table[h]; h = (h + 1) & (size - 1)) {
+                if(!strcmp(table[h]->msgid, segment->msgid)) {
+                    break;
+                }
+            }
+            if(table[h]) {
+                segment->dup = 1;
+                segment->dup_next = table[h]->dups;
+                table[h]->dups = segment;
+            }
+            else {
+                table[h] = segment;
+            }
+        }
+    }
+    free(table);
+}
+
+static int compare_files(const void* a, const void* b) {
+    const file_node* fa = *(const file_node**)a;
+    const file_node* fb = *(const file_node**)b;
+
+    if(s.policy != SCHED_ORDER && fa->type != fb->type) {
+        return fa->type - fb->type;
+    }
+    if(s.policy == SCHED_SMALLEST && fa->bytes != fb->bytes) {
+        return fa->bytes < fb->bytes ? -1 : 1;
+    }
+    return fa->index - fb->index;
+}
+
+/* Queue the recovery volumes the damaged data of a job needs.  Called with
+ * the lock held once everything else in it has been post-processed. */
+static void sched_release_volumes(sched_job* job) {
+    unsigned long long slice = job->slice;
+    unsigned long deficit = 0;
+    unsigned long blocks;
+    segment_node* segment;
+    file_node* file;
+    char* pick;
+    int damaged = 0;
+    int n = 0;
+    int i;
+
+    if((pick = (char*)calloc(job->nheld, 1)) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for(i = 0; i < job->nfiles; i++) {
+        if(job->files[i]->type != FILE_DATA) {
+            continue;
+        }
+        for(segment = job->files[i]->segments; segment; segment = segment->next) {
+            damaged += !segment->done;
+        }
+        if(slice) {
+            deficit += par2_damaged_blocks(job->files[i], slice);
+        }
+    }
+
+    if(damaged && !slice) {
+        printf("%s: %d damaged segments and no par2 slice size, fetching all recovery volumes\n",
+            __FUNCTION__, damaged);
+        memset(pick, 1, job->nheld);
+        blocks = 0;
+    }
+    else {
+        blocks = par2_select(job->held, job->nheld, deficit, pick);
+    }
+
+    for(i = 0; i < job->nheld; i++) {
+        file = job->held[i];
+        if(!pick[i]) {
+            DEBUG("%s: skipping [%s]\n", __FUNCTION__, file->name);
+            continue;
+        }
+        job->files[job->nfiles++] = file;
+        job->remaining++;
+        g.stats.total_bytes += file->bytes;
+        g.stats.total_segments += file->pending;
+        g.stats.queued += file->pending;
+        n++;
+    }
+    if(slice || !damaged) {
+        printf("%s: %d damaged segments, %lu blocks short, fetching %d of %d recovery volumes (%lu blocks)\n",
+            __FUNCTION__, damaged, deficit, n, job->nheld, blocks);
+    }
+    if(blocks < deficit) {
+        fprintf(stderr, "%s: not enough recovery blocks to repair\n", __FUNCTION__);
+    }
+    job->nheld = 0;
+    free(pick);
+    pthread_cond_broadcast(&s.changed);
+}
+
+/* Correct the estimates for a file from a probed segment: the decoded
+ * size of the file and of one part, and the size of that part's article.
+ * yEnc parts are all the same size but the last.  Only the first probe of
+ * a file counts; returns 1 for it. */
+int sched_probed(file_node* file, char* name, unsigned long long size, unsigned long part,
+        unsigned long encoded) {
+    segment_node* segment;
+    unsigned long nparts;
+    unsigned long bytes;
+    long delta = 0;
+
+    if(!part) {
+        return 0;
+    }
+    pthread_mutex_lock(&s.lock);
+    if(file->size) {
+        pthread_mutex_unlock(&s.lock);
+        return 0;
+    }
+    file->size = size;
+    if(*name) {
+        snprintf(file->name, sizeof(file->name), "%s", name);
+    }
+    nparts = (size + part - 1) / part;
+    for(segment = file->segments; segment; segment = segment->next) {
+        if(segment->resolved || segment->number < 1 || segment->number > nparts) {
+            continue;
+        }
+        bytes = segment->number < nparts ? part : size - (nparts - 1) * part;
+        bytes = (unsigned long)((double)bytes * encoded / part);
+        delta += (long)bytes - (long)segment->bytes;
+        segment->bytes = bytes;
+    }
+    file->bytes += delta;
+    g.stats.total_bytes += delta;
+    pthread_mutex_unlock(&s.lock);
+
+    printf("%s: [%s] is %llu bytes in %lu parts, estimate corrected by %+ld bytes\n",
+        __FUNCTION__, file->name, size, nparts, delta);
+    return 1;
+}
+
+/* Let waiting connections look again, e.g. after the stream window moved */
+void sched_wake(void) {
+    pthread_mutex_lock(&s.lock);
+    pthread_cond_broadcast(&s.changed);
+    pthread_mutex_unlock(&s.lock);
+}
+
+/* The par2 index of file's job gives slice as its block size */
+void sched_par2_slice(file_node* file, unsigned long long slice) {
+    pthread_mutex_lock(&s.lock);
+    s.jobs[file->job].slice = slice;
+    pthread_mutex_unlock(&s.lock);
+}
+
+/* Called by post-processing once a file has been decoded */
+void sched_file_done(file_node* file) {
+    sched_job* job = &s.jobs[file->job];
+
+    pthread_mutex_lock(&s.lock);
+    if(job->nheld && file->type != FILE_PAR2_VOL && --job->unfinished == 0) {
+        sched_release_volumes(job);
+    }
+    pthread_mutex_unlock(&s.lock);
+}
+
+int sched_init(int policy) {
+    server_node* server;
+
+    s.policy = policy;
+    s.jobs = NULL;
+    s.njobs = 0;
+    s.vclock = 0;
+    s.control_checked = 0;
+    s.ninflight = 0;
+    s.nsamples = 0;
+    s.hedges = 0;
+    s.retries = NULL;
+    s.nretries = 0;
+    s.requeued = 0;
+    s.failed = 0;
+
+    s.servers = 0;
+    for(server = g.servers; server; server = server->next) {
+        if(server->id < MAX_SERVERS) {
+            s.servers |= 1U << server->id;
+            s.conns[server->id] = server->max;
+        }
+    }
+    return NN_OK;
+}
+
+/* Add the files of one NZB as a job.  Returns the number of files queued. */
+int sched_add(file_node* list, char* name) {
+    sched_job* job;
+    file_node* file;
+    segment_node* segment;
+    char statfile[1024];
+    struct stat fileinfo;
+    int nsegments = 0;
+    int i;
+
+    if((job = (sched_job*)realloc(s.jobs, (s.njobs + 1) * sizeof(sched_job))) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    s.jobs = job;
+    job = &s.jobs[s.njobs];
+    memset(job, 0, sizeof(sched_job));
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    job->weight = 1;
+    job->start = time(NULL);
+
+    for(file = list, i = 0; file; file = file->next, i++) {
+        file->index = i;
+        file->job = s.njobs;
+        file->bytes = 0;
+        file->pending = 0;
+        for(segment = file->segments; segment; segment = segment->next) {
+            file->bytes += segment->bytes;
+            file->pending++;
+        }
+        file->cursor = file->segments;
+        sched_classify(file);
+    }
+
+    if((job->files = (file_node**)calloc(i ? i : 1, sizeof(file_node*))) == NULL
+    || (job->held = (file_node**)calloc(i ? i : 1, sizeof(file_node*))) == NULL) {
+        perror("calloc");
+        return NN_ERROR;
+    }
+    s.njobs++;
+
+    for(file = list; file; file = file->next) {
+        snprintf(statfile, sizeof(statfile), "%s/.%s.done", g.outdir, file->filename);
+        if(stat(statfile, &fileinfo) == 0) {
+            printf("%s: file already finished [%s]\n", __FUNCTION__, file->name);
+            file->done = 1;
+            continue;
+        }
+        if(!file->pending) {
+            continue;
+        }
+        if(g.par2_ondemand && file->type == FILE_PAR2_VOL) {
+            job->held[job->nheld++] = file;
+            continue;
+        }
+        job->unfinished++;
+        job->files[job->nfiles++] = file;
+        nsegments += file->pending;
+    }
+    job->remaining = job->nfiles;
+    qsort(job->files, job->nfiles, sizeof(file_node*), compare_files);
+    sched_find_dups(job, nsegments);
+
+    g.stats.total_segments += nsegments;
+    g.stats.queued += nsegments;
+    for(i = 0; i < job->nfiles; i++) {
+        g.stats.total_bytes += job->files[i]->bytes;
+    }
+
+    for(i = 0; i < job->nfiles; i++) {
+        DEBUG("%s: %3d %s %10lu %s\n", __FUNCTION__, i,
+            job->files[i]->type == FILE_PAR2_INDEX ?   "index" :
+            job->files[i]->type == FILE_PAR2_VOL ?     "vol  " :
+                                                       "data ",
+            job->files[i]->bytes, job->files[i]->name);
+    }
+    if(job->nheld && !job->unfinished) {
+        sched_release_volumes(job);
+    }
+    return job->nfiles;
+}
+
+static void inflight_add(segment_node* segment) {
+    segment_node** grown;
+
+    if(s.ninflight == s.maxinflight) {
+        s.maxinflight = s.maxinflight ? s.maxinflight * 2 : 16;
+        if((grown = realloc(s.inflight, s.maxinflight * sizeof(segment_node*))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        s.inflight = grown;
+    }
+    s.inflight[s.ninflight++] = segment;
+}
+
+static void inflight_remove(segment_node* segment) {
+    int i;
+
+    for(i = 0; i < s.ninflight; i++) {
+        if(s.inflight[i] == segment) {
+            s.inflight[i] = s.inflight[--s.ninflight];
+            break;
+        }
+    }
+}
+
+static int compare_double(const void* a, const void* b) {
+    double da = *(const double*)a;
+    double db = *(const double*)b;
+
+    return da < db ? -1 : da > db;
+}
+
+/* Pick the in-flight segment that is furthest behind the running
+ * percentile of transfer time for its size, if any is behind by more than
+ * the hedge factor. */
+static segment_node* sched_straggler(void) {
+    double sorted[HEDGE_SAMPLES];
+    double pct;
+    double expected;
+    double worst = 1.0;
+    unsigned long long now;
+    unsigned long long elapsed;
+    segment_node* segment = NULL;
+    int n;
+    int i;
+
+    if(s.nsamples < HEDGE_MIN_SAMPLES) {
+        return NULL;
+    }
+    n = s.nsamples < HEDGE_SAMPLES ? s.nsamples : HEDGE_SAMPLES;
+    memcpy(sorted, s.samples, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_double);
+    pct = sorted[(n - 1) * HEDGE_PERCENTILE / 100];
+
+    now = trace_now();
+    for(i = 0; i < s.ninflight; i++) {
+        if(s.inflight[i]->attempts != 1 || s.inflight[i]->won) {
+            continue;
+        }
+        elapsed = now - s.inflight[i]->started;
+        expected = pct * (s.inflight[i]->bytes ? s.inflight[i]->bytes : 1) * g.hedge;
+        if(elapsed > HEDGE_MIN_NS && elapsed > expected
+        && (g.stream ? !segment || s.inflight[i]->number < segment->number : elapsed / expected > worst)) {
+            worst = elapsed / expected;
+            segment = s.inflight[i];
+        }
+    }
+    return segment;
+}
+
+static unsigned int server_bit(server_node* server) {
+    return server && server->id < MAX_SERVERS ? 1U << server->id : 0;
+}
+
+/* Take the first queued retry that 'server' may have now.  A segment that
+ * every remaining server has already answered 430 for goes to anyone, so
+ * its failure is recorded through sched_done(). */
+static segment_node* retry_take(server_node* server, unsigned long long now) {
+    segment_node** ps;
+    segment_node** best = NULL;
+    segment_node* segment;
+
+    for(ps = &s.retries; (segment = *ps) != NULL; ps = &segment->retry_next) {
+        if(segment->not_before > now || s.jobs[segment->file->job].paused) {
+            continue;
+        }
+        if(!(segment->tried & server_bit(server)) || !(~segment->tried & s.servers)) {
+            if(!best || segment->number < (*best)->number) {
+                best = ps;
+            }
+            if(!g.stream) {
+                /* first come, first served */
+                break;
+            }
+        }
+    }
+    if(best) {
+        segment = *best;
+        *best = segment->retry_next;
+        segment->retry_next = NULL;
+        s.nretries--;
+        g.stats.queued--;
+        return segment;
+    }
+    return NULL;
+}
+
+/* Decide what happens to a segment whose last attempt failed.  Returns 1
+ * if it was queued for another attempt. */
+static int retry_queue(segment_node* segment, int rc) {
+    segment_node** ps;
+    unsigned long long delay = 0;
+
+    if(segment->dup || !g.running) {
+        return 0;
+    }
+    if(rc == NN_MISSING) {
+        /* not on this server: try the next one, if any is left */
+        if(!(~segment->tried & s.servers)) {
+            return 0;
+        }
+    }
+    else {
+        if(++segment->failures > RETRY_MAX) {
+            return 0;
+        }
+        if(segment->failures > 1) {
+            delay = RETRY_BASE_NS << (segment->failures - 2);
+            delay = delay < RETRY_MAX_NS ? delay : RETRY_MAX_NS;
+        }
+    }
+    segment->not_before = trace_now() + delay;
+    for(ps = &s.retries; *ps; ps = &(*ps)->retry_next);
+    *ps = segment;
+    s.nretries++;
+    g.stats.queued++;
+    s.requeued++;
+    DEBUG("%s: retrying segment %u of [%s] in %llu ms\n", __FUNCTION__,
+        segment->number, segment->file->name, delay / 1000000);
+    return 1;
+}
+
+/* Whether a job has segments that were never handed out */
+static int job_undispatched(sched_job* job) {
+    while(job->cur < job->nfiles && !job->files[job->cur]->cursor) {
+        job->cur++;
+    }
+    return job->cur < job->nfiles;
+}
+
+/* The job the next new segment comes from, NULL if none may have one */
+static sched_job* sched_pick(void) {
+    sched_job* best = NULL;
+    sched_job* job;
+    int i;
+
+    for(i = 0; i < s.njobs; i++) {
+        job = &s.jobs[i];
+        if(job->paused || !job_undispatched(job)) {
+            continue;
+        }
+        if(!best || job->priority > best->priority
+        || (job->priority == best->priority && job->vtime < best->vtime)) {
+            best = job;
+        }
+    }
+    return best;
+}
+
+/* Whether anything is left to do, paused jobs included */
+static int sched_pending(void) {
+    int i;
+
+    if(s.ninflight || s.nretries) {
+        return 1;
+    }
+    for(i = 0; i < s.njobs; i++) {
+        if(s.jobs[i].nheld || job_undispatched(&s.jobs[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static sched_job* job_find(char* name) {
+    char* end;
+    long n;
+    int i;
+
+    n = strtol(name, &end, 10);
+    if(!*end && n >= 1 && n <= s.njobs) {
+        return &s.jobs[n - 1];
+    }
+    for(i = 0; i < s.njobs; i++) {
+        if(!strcmp(s.jobs[i].name, name)) {
+            return &s.jobs[i];
+        }
+    }
+    return NULL;
+}
+
+/* Re-read the control file if it changed.  Jobs it does not mention go
+ * back to priority 0, weight 1 and running.  Called with the lock held. */
+static void sched_control(void) {
+    unsigned long long now = trace_now();
+    struct stat st;
+    sched_job* job;
+    sched_job* old;
+    FILE* fp;
+    char line[1024];
+    char* name;
+    char* opt;
+    char* val;
+    int i;
+
+    if(!g.control || now - s.control_checked < CONTROL_CHECK_NS) {
+        return;
+    }
+    s.control_checked = now;
+    if(stat(g.control, &st) != 0
+    || (st.st_mtim.tv_sec == s.control_mtime.tv_sec && st.st_mtim.tv_nsec == s.control_mtime.tv_nsec)) {
+        return;
+    }
+    s.control_mtime = st.st_mtim;
+    if((fp = fopen(g.control, "r")) == NULL) {
+        perror(g.control);
+        return;
+    }
+    if((old = (sched_job*)malloc(s.njobs * sizeof(sched_job))) == NULL) {
+        perror("malloc");
+        fclose(fp);
+        return;
+    }
+    memcpy(old, s.jobs, s.njobs * sizeof(sched_job));
+    for(i = 0; i < s.njobs; i++) {
+        s.jobs[i].priority = 0;
+        s.jobs[i].weight = 1;
+        s.jobs[i].paused = 0;
+    }
+    while(fgets(line, sizeof(line), fp)) {
+        if((name = strtok(line, " \t\r\n")) == NULL || *name == '#') {
+            continue;
+        }
+        if((job = job_find(name)) == NULL) {
+            fprintf(stderr, "%s: no job [%s]\n", __FUNCTION__, name);
+            continue;
+        }
+        while((opt = strtok(NULL, " \t\r\n")) != NULL) {
+            if((val = strchr(opt, '=')) == NULL) {
+                fprintf(stderr, "%s: expected key=value, got [%s]\n", __FUNCTION__, opt);
+                continue;
+            }
+            *val++ = '\0';
+            if(!strcasecmp(opt, "priority")) {
+                job->priority = atoi(val);
+            }
+            else if(!strcasecmp(opt, "weight")) {
+                job->weight = atof(val) > 0 ? atof(val) : 1;
+            }
+            else if(!strcasecmp(opt, "paused")) {
+                job->paused = atoi(val) != 0;
+            }
+            else {
+                fprintf(stderr, "%s: unknown setting [%s]\n", __FUNCTION__, opt);
+            }
+        }
+    }
+    fclose(fp);
+
+    for(i = 0; i < s.njobs; i++) {
+        job = &s.jobs[i];
+        if(job->priority == old[i].priority && job->weight == old[i].weight && job->paused == old[i].paused) {
+            continue;
+        }
+        if((old[i].paused && !job->paused) || job->priority != old[i].priority) {
+            job->vtime = job->vtime > s.vclock ? job->vtime : s.vclock;
+        }
+        printf("%s: job %s: priority %d, weight %g%s\n", __FUNCTION__,
+            job->name, job->priority, job->weight, job->paused ? ", paused" : "");
+    }
+    free(old);
+    pthread_cond_broadcast(&s.changed);
+}
+
+/* The next file of the job that has not had a segment handed out yet */
+static file_node* sched_probe(sched_job* job) {
+    file_node* file;
+
+    while(job->probed < job->nfiles) {
+        file = job->files[job->probed++];
+        if(file->cursor == file->segments) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+/* Returns the next segment for a connection to 'server', or NULL once
+ * everything has been resolved. */
+segment_node* sched_next(server_node* server) {
+    segment_node* segment = NULL;
+    sched_job* job;
+    file_node* file;
+    file_node* probe;
+    struct timeval now;
+    struct timespec until;
+    int end;
+    int i;
+
+    pthread_mutex_lock(&s.lock);
+    while(!segment && g.running) {
+        sched_control();
+        if(s.nretries && (segment = retry_take(server, trace_now())) != NULL) {
+            segment->started = trace_now();
+            inflight_add(segment);
+            break;
+        }
+        job = sched_pick();
+        if(job && g.stream && !stream_admit(job->files[job->cur]->cursor)) {
+            /* the read-ahead window is full */
+            job = NULL;
+        }
+        if(!job || (server && server->id > 0 && (s.servers & 1))) {
+            /* endgame, everything paused, a full stream window, or a
+             * backup server while the primary is up: nothing new to hand
+             * out */
+            if(!sched_pending()) {
+                break;
+            }
+            if(g.hedge && !job && (segment = sched_straggler()) != NULL) {
+                s.hedges++;
+                DEBUG("%s: hedging segment %u of [%s]\n", __FUNCTION__,
+                    segment->number, segment->file->name);
+                break;
+            }
+            gettimeofday(&now, NULL);
+            until.tv_sec = now.tv_sec + (now.tv_usec >= 900000);
+            until.tv_nsec = ((now.tv_usec + 100000) % 1000000) * 1000;
+            pthread_cond_timedwait(&s.changed, &s.lock, &until);
+            continue;
+        }
+        file = job->files[job->cur];
+        if(g.probe && (probe = sched_probe(job)) != NULL) {
+            file = probe;
+        }
+        else if(s.policy == SCHED_INTERLEAVE) {
+            /* rotate over the files of the current class */
+            for(end = job->cur; end < job->nfiles && job->files[end]->type == file->type; end++);
+            if(job->rr < job->cur || job->rr >= end) {
+                job->rr = job->cur;
+            }
+            for(i = 0; i < end - job->cur; i++) {
+                file = job->files[job->rr];
+                job->rr = job->rr + 1 < end ? job->rr + 1 : job->cur;
+                if(file->cursor) {
+                    break;
+                }
+            }
+        }
+        segment = file->cursor;
+        file->cursor = segment->next;
+        g.stats.queued--;
+        if(segment->dup) {
+            /* resolved along with its original */
+            segment = NULL;
+            continue;
+        }
+        s.vclock = job->vtime;
+        job->vtime += segment->bytes / job->weight;
+        segment->started = trace_now();
+        inflight_add(segment);
+    }
+    if(segment) {
+        segment->attempts++;
+    }
+    pthread_mutex_unlock(&s.lock);
+    return segment;
+}
+
+/* Called by an attempt that has the complete article.  Returns 1 if this
+ * attempt is the first and should keep its copy. */
+int sched_claim(segment_node* segment) {
+    int ret = 0;
+
+    pthread_mutex_lock(&s.lock);
+    if(!segment->won && !segment->resolved) {
+        segment->won = 1;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&s.lock);
+    return ret;
+}
+
+/* Reports the outcome of one attempt at a segment on 'server' (NULL for
+ * duplicates resolved along with their original); rc is get_segment()'s
+ * result and ns the time it took.  Returns NN_ERROR if the segment is still
+ * open (or was resolved by another attempt, or queued for a retry), 0 if
+ * this call resolved it and 1 if that also completed its file. */
+int sched_done(segment_node* segment, server_node* server, int rc, unsigned long long ns) {
+    int ret = NN_ERROR;
+
+    pthread_mutex_lock(&s.lock);
+    if(segment->attempts > 0) {
+        segment->attempts--;
+    }
+    if(rc == 0 && ns && segment->bytes) {
+        s.samples[s.nsamples++ % HEDGE_SAMPLES] = (double)ns / segment->bytes;
+    }
+    if(rc == NN_MISSING) {
+        segment->tried |= server_bit(server);
+    }
+    if(!segment->resolved && (rc >= 0 || (!segment->won && !segment->attempts))) {
+        inflight_remove(segment);
+        if(rc < 0 && retry_queue(segment, rc)) {
+            pthread_cond_broadcast(&s.changed);
+            pthread_mutex_unlock(&s.lock);
+            return NN_ERROR;
+        }
+        segment->resolved = 1;
+        segment->done = rc >= 0;
+        if(rc < 0) {
+            s.failed++;
+        }
+        __sync_fetch_and_add(&g.stats.done_segments, 1);
+        __sync_fetch_and_add(&g.stats.done_bytes, segment->bytes);
+        ret = (--segment->file->pending == 0);
+        if(ret && s.njobs > 1 && --s.jobs[segment->file->job].remaining == 0) {
+            printf("%s: job %s complete in %lu seconds\n", __FUNCTION__, s.jobs[segment->file->job].name,
+                (unsigned long)(time(NULL) - s.jobs[segment->file->job].start));
+        }
+    }
+    pthread_cond_broadcast(&s.changed);
+    pthread_mutex_unlock(&s.lock);
+    return ret;
+}
+
+/* Returns 1 once every segment has been handed out and resolved */
+int sched_finished(void) {
+    int ret;
+
+    pthread_mutex_lock(&s.lock);
+    ret = !sched_pending();
+    pthread_mutex_unlock(&s.lock);
+    return ret;
+}
+
+/* Called as a connection to 'server' exits for good.  Once a server has no
+ * connections left, retries stop waiting for it, and once the primary has
+ * none the backup servers take new segments too. */
+void sched_leave(server_node* server) {
+    pthread_mutex_lock(&s.lock);
+    if(server_bit(server) && --s.conns[server->id] <= 0) {
+        s.servers &= ~server_bit(server);
+        pthread_cond_broadcast(&s.changed);
+    }
+    pthread_mutex_unlock(&s.lock);
+}
+
+void sched_cleanup(void) {
+    int i;
+
+    if(s.hedges) {
+        printf("%s: %lu hedged requests\n", __FUNCTION__, s.hedges);
+    }
+    if(s.requeued || s.failed) {
+        printf("%s: %lu retries, %lu segments failed\n", __FUNCTION__, s.requeued, s.failed);
+    }
+    for(i = 0; i < s.njobs; i++) {
+        free(s.jobs[i].files);
+        free(s.jobs[i].held);
+    }
+    if(s.jobs) {
+        free(s.jobs); s.jobs = NULL;
+    }
+    if(s.inflight) {
+        free(s.inflight); s.inflight = NULL;
+    }
+    s.njobs = 0;
+    s.ninflight = 0;
+    s.maxinflight = 0;
+}
@@ -0,0 +1,393 @@
+/* Session recording and replay.
+ *
+ * With -W file every connect, command and receive on every connection is
+ * appended to a session file with its time since the recording started.
+ * With -X file no network is used: server_connect() gets a placeholder
+ * descriptor and send_msg()/recv_msg() are answered from the recording,
+ * at the recorded pace or, with -F, as fast as possible.  The rest of the
+ * program, scheduling, decoding and writing included, runs as usual.
+ *
+ * Connections are not replayed one for one, since a replayed run hands out
+ * segments in its own order.  Instead each recorded command, and each
+ * connect for the greeting, is an exchange: the receives that followed it
+ * on its connection, with their delays after the command was sent.  A
+ * replayed command takes the next recorded exchange with the same text,
+ * or the last one again once they run out.  User names and passwords are
+ * not recorded.
+ *
+ * The file is "NZBNSES1\n" followed by records of a session_event header
+ * and 'len' bytes of data, in host byte order:
+ *
+ *  C  connect, the data is the server name
+ *  S  command sent
+ *  R  bytes received, none for the end of the stream
+ *  T  receive timed out
+ *  E  receive failed
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nzbnews.h"
+
+#define SESSION_MAGIC       "NZBNSES1\n"
+#define SESSION_MAX_FDS     4096
+#define SESSION_BUCKETS     (1 << 16)
+#define SESSION_AUTHINFO    "AUTHINFO "
+
+typedef struct _session_event {
+    unsigned int stream;
+    unsigned char type;
+    unsigned char reserved[3];
+    unsigned long long ns;      /* since the recording started */
+    unsigned int len;
+    unsigned int reserved2;
+} session_event;
+
+typedef struct _session_chunk {
+    unsigned long long delay;   /* after the command */
+    char* data;
+    unsigned int len;
+    int rc;                     /* 0, NN_TIMEOUT or NN_ERROR */
+} session_chunk;
+
+typedef struct _session_exchange {
+    struct _session_exchange* next;     /* same command, later on */
+    session_chunk* chunks;
+    int nchunks;
+    int maxchunks;
+} session_exchange;
+
+typedef struct _session_key {
+    struct _session_key* hnext;
+    char* cmd;
+    unsigned int len;
+    session_exchange* first;
+    session_exchange* last;
+    session_exchange* cursor;   /* handed out most recently */
+} session_key;
+
+/* where a replayed connection is in its current exchange */
+typedef struct _session_stream {
+    session_exchange* ex;
+    int chunk;
+    unsigned int off;
+    unsigned long long start;
+} session_stream;
+
+static struct _session_t {
+    pthread_mutex_t lock;
+    /* recording */
+    FILE* fp;
+    unsigned long long epoch;
+    int streams[SESSION_MAX_FDS];   /* stream of each descriptor */
+    unsigned int nstreams;
+    /* replay */
+    char* buf;
+    size_t len;
+    int fast;
+    session_key** buckets;
+    session_stream replay[SESSION_MAX_FDS];
+    unsigned long exchanges;
+    unsigned long misses;
+} s = { PTHREAD_MUTEX_INITIALIZER };
+
+/* Commands are keyed as sent, less the user name and password */
+static unsigned int session_redact(char* cmd, unsigned int len) {
+    size_t n = strlen(SESSION_AUTHINFO);
+    char* p;
+
+    if(len > n && !strncasecmp(cmd, SESSION_AUTHINFO, n) && (p = memchr(cmd + n, ' ', len - n)) != NULL) {
+        return p - cmd;
+    }
+    return len;
+}
+
+static unsigned long session_hash(char* cmd, unsigned int len) {
+    unsigned long h = 5381;
+
+    while(len--) {
+        h = h * 33 + (unsigned char)*cmd++;
+    }
+    return h & (SESSION_BUCKETS - 1);
+}
+
+int session_record(char* path) {
+    if((s.fp = fopen(path, "w")) == NULL) {
+        perror("fopen");
+        return NN_ERROR;
+    }
+    fputs(SESSION_MAGIC, s.fp);
+    s.epoch = trace_now();
+    return NN_OK;
+}
+
+/* Append one event on 'sock' to the recording */
+void session_log(int sock, int type, char* buf, int len) {
+    session_event ev;
+
+    if(!s.fp || sock < 0 || sock >= SESSION_MAX_FDS) {
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.len = len > 0 ? len : 0;
+    if(type == SESSION_SEND) {
+        ev.len = session_redact(buf, ev.len);
+    }
+    pthread_mutex_lock(&s.lock);
+    if(type == SESSION_CONNECT) {
+        s.streams[sock] = s.nstreams++;
+    }
+    ev.stream = s.streams[sock];
+    ev.ns = trace_now() - s.epoch;
+    if(fwrite(&ev, sizeof(ev), 1, s.fp) != 1 || fwrite(buf, 1, ev.len, s.fp) != ev.len) {
+        perror("fwrite");
+        fclose(s.fp);
+        s.fp = NULL;
+    }
+    pthread_mutex_unlock(&s.lock);
+}
+
+static session_key* session_lookup(char* cmd, unsigned int len, int create) {
+    unsigned long h = session_hash(cmd, len);
+    session_key* k;
+
+    for(k = s.buckets[h]; k; k = k->hnext) {
+        if(k->len == len && !memcmp(k->cmd, cmd, len)) {
+            return k;
+        }
+    }
+    if(!create) {
+        return NULL;
+    }
+    if((k = (session_key*)calloc(1, sizeof(session_key))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    k->cmd = cmd;
+    k->len = len;
+    k->hnext = s.buckets[h];
+    s.buckets[h] = k;
+    return k;
+}
+
+/* Load a recording and split it into exchanges */
+int session_replay(char* path, int fast) {
+    session_exchange** current = NULL;     /* per recorded stream */
+    unsigned long long* start = NULL;
+    unsigned int nstreams = 0;
+    session_exchange* ex;
+    session_chunk* chunk;
+    session_event ev;
+    session_key* k;
+    struct stat st;
+    size_t off;
+    void* grown;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return NN_ERROR;
+    }
+    s.len = st.st_size;
+    if((s.buf = (char*)malloc(s.len + 1)) == NULL
+    || (s.buckets = (session_key**)calloc(SESSION_BUCKETS, sizeof(session_key*))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if(read(fd, s.buf, s.len) != s.len || s.len < strlen(SESSION_MAGIC)
+    || memcmp(s.buf, SESSION_MAGIC, strlen(SESSION_MAGIC))) {
+        fprintf(stderr, "%s: %s is not a session recording\n", __FUNCTION__, path);
+        close(fd);
+        return NN_ERROR;
+    }
+    close(fd);
+    s.fast = fast;
+
+    for(off = strlen(SESSION_MAGIC); off + sizeof(ev) <= s.len; off += sizeof(ev) + ev.len) {
+        memcpy(&ev, s.buf + off, sizeof(ev));
+        if(off + sizeof(ev) + ev.len > s.len) {
+            fprintf(stderr, "%s: %s is truncated\n", __FUNCTION__, path);
+            break;
+        }
+        if(ev.stream >= nstreams) {
+            if((grown = realloc(current, (ev.stream + 1) * sizeof(session_exchange*))) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            current = (session_exchange**)grown;
+            if((grown = realloc(start, (ev.stream + 1) * sizeof(unsigned long long))) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            start = (unsigned long long*)grown;
+            memset(current + nstreams, 0, (ev.stream + 1 - nstreams) * sizeof(session_exchange*));
+            nstreams = ev.stream + 1;
+        }
+
+        switch(ev.type) {
+        case SESSION_CONNECT:
+        case SESSION_SEND:
+            if((ex = (session_exchange*)calloc(1, sizeof(session_exchange))) == NULL) {
+                perror("calloc");
+                exit(1);
+            }
+            k = ev.type == SESSION_CONNECT ? session_lookup("", 0, 1)
+                                           : session_lookup(s.buf + off + sizeof(ev), ev.len, 1);
+            if(k->last) {
+                k->last->next = ex;
+            }
+            else {
+                k->first = ex;
+            }
+            k->last = ex;
+            current[ev.stream] = ex;
+            start[ev.stream] = ev.ns;
+            s.exchanges++;
+            break;
+        case SESSION_RECV:
+        case SESSION_TIMEOUT:
+        case SESSION_ERROR:
+            if((ex = current[ev.stream]) == NULL) {
+                break;
+            }
+            if(ex->nchunks == ex->maxchunks) {
+                ex->maxchunks = ex->maxchunks ? ex->maxchunks * 2 : 4;
+                if((grown = realloc(ex->chunks, ex->maxchunks * sizeof(session_chunk))) == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+                ex->chunks = (session_chunk*)grown;
+            }
+            chunk = &ex->chunks[ex->nchunks++];
+            chunk->delay = ev.ns - start[ev.stream];
+            chunk->data = s.buf + off + sizeof(ev);
+            chunk->len = ev.len;
+            chunk->rc = ev.type == SESSION_TIMEOUT ? NN_TIMEOUT : ev.type == SESSION_ERROR ? NN_ERROR : 0;
+            break;
+        default:
+            fprintf(stderr, "%s: unknown event '%c' in %s\n", __FUNCTION__, ev.type, path);
+            break;
+        }
+    }
+    free(current);
+    free(start);
+    printf("%s: %lu exchanges on %u connections from %s\n", __FUNCTION__, s.exchanges, nstreams, path);
+    return NN_OK;
+}
+
+/* Start the next exchange for 'cmd' on 'sock' */
+static void session_begin(int sock, char* cmd, unsigned int len) {
+    session_stream* st = &s.replay[sock];
+    session_key* k;
+
+    pthread_mutex_lock(&s.lock);
+    if((k = session_lookup(cmd, len, 0)) != NULL) {
+        k->cursor = k->cursor && k->cursor->next ? k->cursor->next : k->cursor ? k->cursor : k->first;
+        st->ex = k->cursor;
+    }
+    else {
+        st->ex = NULL;
+        s.misses++;
+    }
+    pthread_mutex_unlock(&s.lock);
+    if(!k) {
+        fprintf(stderr, "%s: no recorded response to [%.*s]\n", __FUNCTION__,
+            (int)(len > 2 ? len - 2 : len), cmd);
+    }
+    st->chunk = 0;
+    st->off = 0;
+    st->start = trace_now();
+}
+
+/* A descriptor standing in for a socket, with the greeting queued */
+int session_connect(void) {
+    int sock;
+
+    if((sock = open("/dev/null", O_RDWR)) < 0) {
+        perror("open");
+        return NN_ERROR;
+    }
+    if(sock >= SESSION_MAX_FDS) {
+        fprintf(stderr, "%s: too many connections\n", __FUNCTION__);
+        close(sock);
+        return NN_ERROR;
+    }
+    session_begin(sock, "", 0);
+    return sock;
+}
+
+int session_send(int sock, char* buf, int len) {
+    if(sock < 0 || sock >= SESSION_MAX_FDS) {
+        return NN_ERROR;
+    }
+    session_begin(sock, buf, session_redact(buf, len));
+    return len;
+}
+
+int session_recv(int sock, char* buf, int len) {
+    session_stream* st;
+    session_chunk* chunk;
+    unsigned long long due, now;
+    struct timespec ts;
+    int n;
+
+    if(sock < 0 || sock >= SESSION_MAX_FDS) {
+        return NN_ERROR;
+    }
+    st = &s.replay[sock];
+    if(!st->ex || st->chunk >= st->ex->nchunks) {
+        return NN_TIMEOUT;      /* the server said nothing more */
+    }
+    chunk = &st->ex->chunks[st->chunk];
+    if(!s.fast && (due = st->start + chunk->delay) > (now = trace_now())) {
+        ts.tv_sec = (due - now) / 1000000000ULL;
+        ts.tv_nsec = (due - now) % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+    if(chunk->rc || !chunk->len) {
+        st->chunk++;
+        return chunk->rc;
+    }
+    n = chunk->len - st->off < len ? chunk->len - st->off : len;
+    memcpy(buf, chunk->data + st->off, n);
+    if((st->off += n) == chunk->len) {
+        st->chunk++;
+        st->off = 0;
+    }
+    return n;
+}
+
+void session_cleanup(void) {
+    session_key* k;
+    session_exchange* ex;
+    int i;
+
+    if(s.fp) {
+        fclose(s.fp);
+        s.fp = NULL;
+    }
+    if(!s.buckets) {
+        return;
+    }
+    if(s.misses) {
+        fprintf(stderr, "%s: %lu commands had no recorded response\n", __FUNCTION__, s.misses);
+    }
+    for(i = 0; i < SESSION_BUCKETS; i++) {
+        while((k = s.buckets[i]) != NULL) {
+            s.buckets[i] = k->hnext;
+            while((ex = k->first) != NULL) {
+                k->first = ex->next;
+                free(ex->chunks);
+                free(ex);
+            }
+            free(k);
+        }
+    }
+    free(s.buckets); s.buckets = NULL;
+    free(s.buf); s.buf = NULL;
+}
@@ -0,0 +1,320 @@
+/* Streaming one file to stdout or a FIFO.
+ *
+ * With -O only the selected file is downloaded, and its segments are
+ * decoded and written out strictly in order as they arrive, so a player or
+ * an extractor can start on the data before the download is complete.
+ * Nothing is decoded to disk: each segment file is removed once written.
+ *
+ * The segments are dispatched by number, and the scheduler hands out no
+ * segment more than the read-ahead window past the write cursor, which
+ * bounds the segment files held on disk and keeps the connections on the
+ * data that is needed next.  While the window is full, idle connections
+ * hedge the in-flight segment closest to the cursor (see sched.c), and
+ * retries go lowest number first.
+ *
+ * A single writer thread waits for the segment at the cursor, so a slow
+ * reader holds back only the writer and, through the window, the
+ * downloads; never a connection thread.  The =ypart offsets place each
+ * segment: a gap is filled with zeros and an overlap skipped.  A segment
+ * that could not be fetched is written as zeros the size of the previous
+ * part, keeping the later data at its offset for a par2 repair.
+ *
+ * When stdout is the stream, the messages that normally go there are
+ * moved to stderr.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nzbnews.h"
+
+static struct _stream_t {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    file_node* file;
+    segment_node** order;       /* segments by number */
+    int nsegments;
+    int next;                   /* write cursor */
+    int window;
+    int fd;
+    int closed;
+    unsigned long long offset;  /* bytes written */
+    unsigned long partsize;     /* decoded size of the last part */
+    unsigned long zeroed;       /* segments written as zeros */
+    pthread_t thread;
+} st = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, 0, -1 };
+
+/* Case-insensitive strstr() */
+static int contains(char* str, char* part) {
+    size_t len = strlen(part);
+
+    for(; *str; str++) {
+        if(!strncasecmp(str, part, len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int compare_number(const void* a, const void* b) {
+    unsigned int x = (*(segment_node**)a)->number;
+    unsigned int y = (*(segment_node**)b)->number;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Detach the file to stream from the list.  pattern is the file's
+ * position in the NZB, counting from 1, or a case-insensitive part of its
+ * subject. */
+file_node* stream_select(file_node** list, char* pattern) {
+    file_node** pf;
+    file_node* file;
+    char* end;
+    long n = strtol(pattern, &end, 10);
+    int i;
+
+    for(pf = list, i = 1; (file = *pf) != NULL; pf = &file->next, i++) {
+        if(*end == '\0' ? i == n : contains(file->subject, pattern)) {
+            *pf = file->next;
+            file->next = NULL;
+            return file;
+        }
+    }
+    return NULL;
+}
+
+static int write_all(int fd, unsigned char* buf, size_t len) {
+    ssize_t rc;
+
+    while(len > 0) {
+        if((rc = write(fd, buf, len)) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return NN_ERROR;
+        }
+        buf += rc;
+        len -= rc;
+    }
+    return NN_OK;
+}
+
+static int write_zeros(int fd, unsigned long long len) {
+    static unsigned char zeros[65536];
+    size_t n;
+
+    while(len > 0) {
+        n = len < sizeof(zeros) ? len : sizeof(zeros);
+        if(write_all(fd, zeros, n) < 0) {
+            return NN_ERROR;
+        }
+        len -= n;
+    }
+    return NN_OK;
+}
+
+/* Decode one segment file and write it at its place in the stream */
+static int stream_segment(segment_node* segment, char** buf, unsigned char** out, size_t* buflen) {
+    char filename[1024];
+    struct stat finfo;
+    yenc_info info;
+    FILE* fp;
+    unsigned long long begin;
+    unsigned long skip = 0;
+    int len = NN_ERROR;
+
+    snprintf(filename, sizeof(filename), "%s/.%s.%u", g.outdir, st.file->filename, segment->number);
+    if(segment->done && stat(filename, &finfo) == 0 && (fp = fopen(filename, "r")) != NULL) {
+        if(finfo.st_size + 1 > *buflen) {
+            *buflen = finfo.st_size + 1;
+            free(*buf);
+            free(*out);
+            *buf = malloc(*buflen);
+            *out = malloc(*buflen);
+            if(!*buf || !*out) {
+                perror("malloc");
+                exit(1);
+            }
+        }
+        if(fread(*buf, 1, finfo.st_size, fp) == finfo.st_size) {
+            len = yenc_decode(*buf, finfo.st_size, *out, *buflen, &info);
+        }
+        fclose(fp);
+    }
+    unlink(filename);
+
+    if(len < 0) {
+        fprintf(stderr, "%s: segment %u of [%s] missing, writing %lu zero bytes\n", __FUNCTION__,
+            segment->number, st.file->name, st.partsize);
+        st.zeroed++;
+        st.offset += st.partsize;
+        return write_zeros(st.fd, st.partsize);
+    }
+    if(info.has_pcrc32 && info.pcrc32 != info.crc32) {
+        fprintf(stderr, "%s: crc mismatch in segment %u of [%s]\n", __FUNCTION__,
+            segment->number, st.file->name);
+    }
+    if(info.begin > 0) {
+        begin = info.begin - 1;
+        if(begin > st.offset) {
+            if(write_zeros(st.fd, begin - st.offset) < 0) {
+                return NN_ERROR;
+            }
+            st.offset = begin;
+        }
+        else if(begin < st.offset) {
+            skip = st.offset - begin < len ? st.offset - begin : len;
+        }
+    }
+    st.partsize = len;
+    st.offset += len - skip;
+    return write_all(st.fd, *out + skip, len - skip);
+}
+
+static void* stream_thread(void* arg) {
+    segment_node* segment;
+    char* buf = NULL;
+    unsigned char* out = NULL;
+    size_t buflen = 0;
+
+    trace_thread_name("stream");
+    for(;;) {
+        pthread_mutex_lock(&st.lock);
+        while(st.next < st.nsegments && !st.closed
+        && !__atomic_load_n(&st.order[st.next]->resolved, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&st.ready, &st.lock);
+        }
+        if(st.next == st.nsegments
+        || !__atomic_load_n(&st.order[st.next]->resolved, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_unlock(&st.lock);
+            break;
+        }
+        segment = st.order[st.next];
+        pthread_mutex_unlock(&st.lock);
+
+        if(stream_segment(segment, &buf, &out, &buflen) < 0) {
+            perror("write");
+            g.running = 0;
+            break;
+        }
+
+        pthread_mutex_lock(&st.lock);
+        st.next++;
+        pthread_mutex_unlock(&st.lock);
+        sched_wake();
+    }
+    free(buf);
+    free(out);
+    return NULL;
+}
+
+/* Start streaming file to path, or to stdout if path is NULL or "-".  A
+ * path that does not exist is created as a FIFO; opening it waits for a
+ * reader.  Must be called before the file is given to sched_add(), which
+ * then dispatches the segments by number. */
+int stream_open(file_node* file, char* path, int window) {
+    segment_node* segment;
+    int i;
+
+    for(segment = file->segments; segment; segment = segment->next) {
+        st.nsegments++;
+    }
+    if((st.order = (segment_node**)calloc(st.nsegments ? st.nsegments : 1, sizeof(segment_node*))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for(segment = file->segments, i = 0; segment; segment = segment->next) {
+        st.order[i++] = segment;
+    }
+    qsort(st.order, st.nsegments, sizeof(segment_node*), compare_number);
+    for(i = 0; i < st.nsegments; i++) {
+        st.order[i]->next = i + 1 < st.nsegments ? st.order[i + 1] : NULL;
+    }
+    file->segments = st.nsegments ? st.order[0] : NULL;
+
+    if(!path || !strcmp(path, "-")) {
+        fflush(stdout);
+        if((st.fd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("dup");
+            return NN_ERROR;
+        }
+    }
+    else {
+        if(access(path, F_OK) != 0 && mkfifo(path, 0644) != 0) {
+            perror("mkfifo");
+            return NN_ERROR;
+        }
+        fprintf(stderr, "%s: waiting for a reader on %s\n", __FUNCTION__, path);
+        if((st.fd = open(path, O_WRONLY)) < 0) {
+            perror("open");
+            return NN_ERROR;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    st.file = file;
+    st.next = 0;
+    st.window = window > 0 ? window : 1;
+    st.offset = 0;
+    st.partsize = file->segments ? file->segments->bytes : 0;
+    st.closed = 0;
+    if(pthread_create(&st.thread, NULL, stream_thread, NULL) != 0) {
+        perror("pthread_create");
+        return NN_ERROR;
+    }
+    return NN_OK;
+}
+
+/* Whether the scheduler may dispatch segment now: it must lie within the
+ * read-ahead window past the write cursor.  Called with the scheduler's
+ * lock held. */
+int stream_admit(segment_node* segment) {
+    int last;
+    int ret;
+
+    pthread_mutex_lock(&st.lock);
+    last = st.next + st.window - 1 < st.nsegments ? st.next + st.window - 1 : st.nsegments - 1;
+    ret = segment->file != st.file || last < 0 || segment->number <= st.order[last]->number;
+    pthread_mutex_unlock(&st.lock);
+    return ret;
+}
+
+/* A segment of the streamed file was resolved */
+void stream_wake(file_node* file) {
+    if(file != st.file) {
+        return;
+    }
+    pthread_mutex_lock(&st.lock);
+    pthread_cond_signal(&st.ready);
+    pthread_mutex_unlock(&st.lock);
+}
+
+/* Write out whatever is resolved, then close the stream.  Returns NN_OK if
+ * the whole file was written without gaps. */
+int stream_finish(void) {
+    int ret;
+
+    if(!st.file) {
+        return NN_OK;
+    }
+    pthread_mutex_lock(&st.lock);
+    st.closed = 1;
+    pthread_cond_signal(&st.ready);
+    pthread_mutex_unlock(&st.lock);
+    pthread_join(st.thread, NULL);
+
+    close(st.fd);
+    ret = st.next == st.nsegments && !st.zeroed ? NN_OK : NN_ERROR;
+    fprintf(stderr, "%s: %d of %d segments of [%s] written (%llu bytes, %lu zero filled)\n",
+        __FUNCTION__, st.next, st.nsegments, st.file->name, st.offset, st.zeroed);
+    free(st.order);
+    st.order = NULL;
+    st.file = NULL;
+    return ret;
+}
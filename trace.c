@@ -0,0 +1,138 @@
+/* Timeline tracing.
+ *
+ * Spans are written to a per-thread ring buffer with no locking on the
+ * record path; the only lock is taken once per thread when its ring is
+ * registered.  At exit the rings are dumped in Chrome trace-event format,
+ * which loads in chrome://tracing and ui.perfetto.dev.  When the ring of a
+ * thread wraps, its oldest spans are overwritten.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nzbnews.h"
+
+#define TRACE_RING_SIZE     65536   /* spans per thread, power of two */
+
+typedef struct _trace_event {
+    const char* name;
+    unsigned long long start;
+    unsigned long long end;
+    long arg;
+} trace_event;
+
+typedef struct _trace_ring {
+    struct _trace_ring* next;
+    int tid;
+    char name[32];
+    unsigned long head;     /* total spans recorded */
+    trace_event events[TRACE_RING_SIZE];
+} trace_ring;
+
+static struct _trace_t {
+    pthread_mutex_t lock;
+    trace_ring* rings;
+    int ntids;
+    unsigned long long epoch;
+} t = { PTHREAD_MUTEX_INITIALIZER };
+
+static __thread trace_ring* ring = NULL;
+
+unsigned long long trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_init(void) {
+    t.epoch = trace_now();
+}
+
+static trace_ring* trace_ring_get(void) {
+    if(!ring) {
+        if((ring = (trace_ring*)calloc(1, sizeof(trace_ring))) == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&t.lock);
+        ring->tid = ++t.ntids;
+        snprintf(ring->name, sizeof(ring->name), "thread %d", ring->tid);
+        ring->next = t.rings;
+        t.rings = ring;
+        pthread_mutex_unlock(&t.lock);
+    }
+    return ring;
+}
+
+/* Name the calling thread in the trace, e.g. "conn 2" */
+void trace_thread_name(char* name) {
+    trace_ring* r;
+
+    if(!g.trace || (r = trace_ring_get()) == NULL) {
+        return;
+    }
+    strncpy(r->name, name, sizeof(r->name) - 1);
+}
+
+/* Returns the start time of a span, or 0 when tracing is off */
+unsigned long long trace_begin(void) {
+    return g.trace ? trace_now() : 0;
+}
+
+/* Record a span that started at 'start'.  'name' must be a string literal,
+ * only the pointer is kept. */
+void trace_end(const char* name, unsigned long long start, long arg) {
+    trace_ring* r;
+    trace_event* ev;
+
+    if(!start || (r = trace_ring_get()) == NULL) {
+        return;
+    }
+    ev = &r->events[r->head & (TRACE_RING_SIZE - 1)];
+    ev->name = name;
+    ev->start = start;
+    ev->end = trace_now();
+    ev->arg = arg;
+    r->head++;
+}
+
+/* Write all rings to g.trace.  Call once the other threads have exited. */
+int trace_dump(void) {
+    trace_ring* r;
+    trace_event* ev;
+    unsigned long i;
+    unsigned long first;
+    FILE* fp;
+    int comma = 0;
+
+    if(!g.trace) {
+        return NN_OK;
+    }
+    if((fp = fopen(g.trace, "w")) == NULL) {
+        perror("fopen");
+        return NN_ERROR;
+    }
+    fprintf(fp, "{\"traceEvents\":[\n");
+    pthread_mutex_lock(&t.lock);
+    for(r = t.rings; r; r = r->next) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}}",
+            comma++ ? ",\n" : "", r->tid, r->name);
+        first = r->head > TRACE_RING_SIZE ? r->head - TRACE_RING_SIZE : 0;
+        for(i = first; i < r->head; i++) {
+            ev = &r->events[i & (TRACE_RING_SIZE - 1)];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%ld}}",
+                ev->name, r->tid,
+                (ev->start - t.epoch) / 1000.0,
+                (ev->end - ev->start) / 1000.0,
+                ev->arg);
+        }
+    }
+    pthread_mutex_unlock(&t.lock);
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    printf("%s: trace written to %s\n", __FUNCTION__, g.trace);
+    return NN_OK;
+}
@@ -0,0 +1,130 @@
+/* yEnc decoding and CRC32, used to check segments before they are handed
+ * to uudeview.
+ *
+ * Segment files keep the article's CRLF line endings; the decoder treats
+ * any run of CR/LF as a line break, so bare LFs from other sources decode
+ * too.  yEnc escapes CR and LF in the payload, which makes that safe.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nzbnews.h"
+
+static unsigned long crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void) {
+    unsigned long c;
+    int n, k;
+
+    for(n = 0; n < 256; n++) {
+        c = (unsigned long)n;
+        for(k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+unsigned long crc32_update(unsigned long crc, const unsigned char* buf, size_t len) {
+    /* post-processing workers and image.c may get here at the same time */
+    pthread_once(&crc_table_once, crc32_init);
+    crc = crc ^ 0xffffffffUL;
+    while(len--) {
+        crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffffUL;
+}
+
+/* Find key= on a =y header line and return its value */
+static char* yenc_key(char* line, char* end, char* key) {
+    size_t klen = strlen(key);
+    char* p;
+
+    for(p = line; p + klen < end; p++) {
+        if((p == line || p[-1] == ' ') && !strncmp(p, key, klen)) {
+            return p + klen;
+        }
+    }
+    return NULL;
+}
+
+static void yenc_header(char* line, char* end, yenc_info* info) {
+    char* p;
+    size_t len;
+
+    if(!strncmp(line, "=ybegin ", 8)) {
+        info->found = 1;
+        if((p = yenc_key(line, end, "part=")) != NULL) {
+            info->part = strtoul(p, NULL, 10);
+        }
+        if((p = yenc_key(line, end, "size=")) != NULL) {
+            info->size = strtoul(p, NULL, 10);
+        }
+        /* name= runs to the end of the line */
+        if((p = yenc_key(line, end, "name=")) != NULL) {
+            len = end - p < sizeof(info->name) - 1 ? end - p : sizeof(info->name) - 1;
+            memcpy(info->name, p, len);
+            info->name[len] = '\0';
+        }
+    }
+    else if(!strncmp(line, "=ypart ", 7)) {
+        if((p = yenc_key(line, end, "begin=")) != NULL) {
+            info->begin = strtoul(p, NULL, 10);
+        }
+        if((p = yenc_key(line, end, "end=")) != NULL) {
+            info->end = strtoul(p, NULL, 10);
+        }
+    }
+    else if(!strncmp(line, "=yend", 5)) {
+        info->ended = 1;
+        if((p = yenc_key(line, end, "pcrc32=")) != NULL) {
+            info->pcrc32 = strtoul(p, NULL, 16);
+            info->has_pcrc32 = 1;
+        }
+    }
+}
+
+/* Decodes the yEnc body in src into dst.  Returns the number of bytes
+ * decoded, or NN_ERROR if no =ybegin line was found. */
+int yenc_decode(char* src, size_t len, unsigned char* dst, size_t dstlen, yenc_info* info) {
+    char* p = src;
+    char* end = src + len;
+    char* eol;
+    size_t out = 0;
+    int escape;
+
+    memset(info, 0, sizeof(yenc_info));
+
+    while(p < end) {
+        for(eol = p; eol < end && *eol != '\r' && *eol != '\n'; eol++);
+
+        if(eol - p >= 2 && p[0] == '=' && p[1] == 'y') {
+            yenc_header(p, eol, info);
+        }
+        else if(info->found && !info->ended) {
+            escape = 0;
+            for(; p < eol && out < dstlen; p++) {
+                if(escape) {
+                    dst[out++] = (unsigned char)(*p - 64 - 42);
+                    escape = 0;
+                }
+                else if(*p == '=') {
+                    escape = 1;
+                }
+                else {
+                    dst[out++] = (unsigned char)(*p - 42);
+                }
+            }
+        }
+        for(p = eol; p < end && (*p == '\r' || *p == '\n'); p++);
+    }
+
+    if(!info->found) {
+        return NN_ERROR;
+    }
+    info->bytes = out;
+    info->crc32 = crc32_update(0, dst, out);
+    return (int)out;
+}